@@ -580,13 +580,27 @@ func main() {
 
   }
 
-  /* connect to this socket, and port */
-  conn, err := net.Dial( "tcp", cfg.Section("network").Key("ipaddr").String() +
-                        ":" + strconv.Itoa(cfg.Section("network").Key(
-                        "port").RangeInt(1155, 1, 65535)) )
+  /* connect to the local socket if there is one, else this ip, and port */
+  var conn net.Conn
+  path := cfg.Section( "network" ).Key( "unix_socket" ).String()
+
+  if ( path != "" ) {
+    conn, err = net.Dial( "unix", path )
+  } else {
+    conn, err = net.Dial( "tcp", cfg.Section("network").Key("ipaddr").String() +
+                          ":" + strconv.Itoa(cfg.Section("network").Key(
+                          "port").RangeInt(1155, 1, 65535)) )
+  }
 
   /* Handle error should it occur */
-  if ( err != nil ) {
+  if ( err != nil && path != "" ) {
+
+    fmt.Println( "Unable to connect to " + path + ", is the server running?" )
+    fmt.Println( "need to update unix_socket in kl-client.ini?" )
+
+    os.Exit( 1 )
+
+  } else if ( err != nil ) {
 
     fmt.Println( "Unable to connect to " + cfg.Section("network").Key(
                  "ipaddr").String() + ":" + strconv.Itoa(cfg.Section(
@@ -0,0 +1,238 @@
+/*
+ * A device's valid commands, compiled once from its comma delimited
+ * valid_cmnds, so a command is checked without scanning them.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (C) 2019-2021, Christian Kissinger
+ * kiss-light Hub is released under the New BSD license (see LICENSE).
+ * Go to the project repo here:
+ * https://gitlab.com/kiss-light-project/Kiss-Light_Hub
+ *
+ * Written by: Christian Kissinger
+ */
+
+// system-related includes
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+// local includes
+#include "cmndset.h"
+#include "hashindex.h"
+
+/* the commands built in dev_types are made of, and their bits */
+static const struct
+{
+    const char *name;
+    int len;
+    uint32_t bit;
+} known_cmnds[] = {
+    { "POWER", 5, CMND_POWER },
+    { "DIMMER", 6, CMND_DIMMER },
+    { "COLOR", 5, CMND_COLOR },
+    { "HSBCOLOR", 8, CMND_HSBCOLOR },
+    { "WHITE", 5, CMND_WHITE },
+    { "CT", 2, CMND_CT }
+};
+
+enum {
+    KNOWN_CMNDS_LEN = sizeof(known_cmnds) / sizeof(known_cmnds[0]),
+
+    // what classify_command() finds a command to be
+    CMND_IS_CUSTOM = 0,
+    CMND_IS_KNOWN = 1,
+    CMND_IS_RELAY = 2
+};
+
+/**
+ * @brief Find out whether a command is a known one, a relay or custom.
+ *
+ * @param cmnd the command, need not be terminated.
+ * @param len the length of cmnd.
+ * @param bit set to the command's bit, or its relay number.
+ *
+ * @note Returns CMND_IS_KNOWN, CMND_IS_RELAY or CMND_IS_CUSTOM.
+ */
+static int classify_command( const char *cmnd, const int len, uint32_t *bit )
+{
+    for ( int i = 0; i < KNOWN_CMNDS_LEN; i++ )
+    {
+        if ( len == known_cmnds[i].len &&
+             strncasecmp(cmnd, known_cmnds[i].name, len) == 0 )
+        {
+            *bit = known_cmnds[i].bit;
+            return CMND_IS_KNOWN;
+        }
+    }
+
+    /* POWER<n>, written the way powerstrip_cmnd_cat() does */
+    if ( len < 6 || len > 7 || strncasecmp(cmnd, "POWER", 5) != 0
+      || (len == 7 && cmnd[5] == '0') )
+    {
+        return CMND_IS_CUSTOM;
+    }
+
+    uint32_t relay = 0;
+
+    for ( int i = 5; i < len; i++ )
+    {
+        if ( !isdigit( (unsigned char)cmnd[i] ) )
+        {
+            return CMND_IS_CUSTOM;
+        }
+
+        relay = relay * 10 + (cmnd[i] - '0');
+    }
+
+    if ( relay > CMND_RELAY_MAX )
+    {
+        return CMND_IS_CUSTOM;
+    }
+
+    *bit = relay;
+
+    return CMND_IS_RELAY;
+}
+
+/**
+ * @brief Compile a device's valid commands.
+ *
+ * @param cs the compiled commands, THIS GETS MODIFIED.
+ * @param cmnds the valid commands, delimited by a comma. Custom commands
+ * refer back to it, so it must outlive cs and stay the same.
+ */
+void cmnd_set_compile( cmnd_set *cs, const char *cmnds )
+{
+    memset( cs, 0, sizeof(cmnd_set) );
+
+    int start = 0;
+
+    for ( int i = 0; ; i++ )
+    {
+        if ( cmnds[i] != ',' && cmnds[i] != '\0' )
+        {
+            continue;
+        }
+
+        const char *cmnd = cmnds + start;
+        int len = i - start;
+        uint32_t bit;
+
+        switch ( len > 0 ? classify_command( cmnd, len, &bit ) : -1 )
+        {
+            case CMND_IS_KNOWN:
+                cs->known |= bit;
+                break;
+
+            case CMND_IS_RELAY:
+                cs->relays |= (uint32_t)1 << bit;
+                break;
+
+            case CMND_IS_CUSTOM:
+            {
+                cs->custom_count++;
+
+                /* the rest get scanned for by cmnd_set_has() */
+                if ( cs->custom_count > CMND_CUSTOM_MAX || start > 255 ||
+                     len > 255 )
+                {
+                    cs->custom_count = CMND_CUSTOM_MAX + 1;
+                    break;
+                }
+
+                uint32_t h = hash_index_hash( cmnd, len );
+                int pos = h & (CMND_CUSTOM_LEN - 1);
+
+                while ( cs->custom[pos].len != 0 )
+                {
+                    pos = (pos + 1) & (CMND_CUSTOM_LEN - 1);
+                }
+
+                cs->custom[pos].hash = h;
+                cs->custom[pos].off = start;
+                cs->custom[pos].len = len;
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        if ( cmnds[i] == '\0' )
+        {
+            break;
+        }
+
+        start = i + 1;
+    }
+}
+
+/**
+ * @brief Check a command against a device's compiled commands.
+ *
+ * @param cs the compiled commands.
+ * @param cmnds the valid commands they were compiled from.
+ * @param input the command of interest, case-insensitive.
+ *
+ * @note Returns nonzero if the command is valid, 0 otherwise.
+ */
+int cmnd_set_has( const cmnd_set *cs, const char *cmnds, const char *input )
+{
+    int len = strlen( input );
+    uint32_t bit = 0;
+
+    switch ( len > 0 ? classify_command( input, len, &bit ) : -1 )
+    {
+        case CMND_IS_KNOWN:
+            return (cs->known & bit) != 0;
+
+        case CMND_IS_RELAY:
+            return (cs->relays >> bit) & 1;
+
+        case CMND_IS_CUSTOM:
+            break;
+
+        default:
+            return 0;
+    }
+
+    uint32_t h = hash_index_hash( input, len );
+    int pos = h & (CMND_CUSTOM_LEN - 1);
+
+    while ( cs->custom[pos].len != 0 )
+    {
+        const cmnd_custom *cc = &cs->custom[pos];
+
+        if ( cc->hash == h && cc->len == len &&
+             strncasecmp(cmnds + cc->off, input, len) == 0 )
+        {
+            return 1;
+        }
+
+        pos = (pos + 1) & (CMND_CUSTOM_LEN - 1);
+    }
+
+    /* too many custom commands to keep, so look for it the long way */
+    if ( cs->custom_count > CMND_CUSTOM_MAX )
+    {
+        for ( const char *p = cmnds; *p != '\0'; )
+        {
+            const char *end = strchr( p, ',' );
+            int tok_len = end != NULL ? end - p : (int)strlen( p );
+
+            if ( tok_len == len && strncasecmp(p, input, len) == 0 )
+            {
+                return 1;
+            }
+
+            if ( end == NULL )
+            {
+                break;
+            }
+
+            p = end + 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (C) 2019-2021, Christian Kissinger
+ * kiss-light Hub is released under the New BSD license (see LICENSE).
+ * Go to the project repo here:
+ * https://gitlab.com/kiss-light-project/Kiss-Light_Hub
+ *
+ * Written by: Christian Kissinger
+ */
+
+#ifndef CMNDSET_H_
+#define CMNDSET_H_
+
+/* Includes in case the compiler complains */
+#include <stdint.h>
+
+/* Constants */
+enum {
+    // the commands every built in dev_type is made of
+    CMND_POWER = 1 << 0,
+    CMND_DIMMER = 1 << 1,
+    CMND_COLOR = 1 << 2,
+    CMND_HSBCOLOR = 1 << 3,
+    CMND_WHITE = 1 << 4,
+    CMND_CT = 1 << 5,
+
+    // POWER0 up to this are relays, anything higher is a custom command
+    CMND_RELAY_MAX = 31,
+
+    /* custom command buckets, must be a power of 2 */
+    CMND_CUSTOM_LEN = 16,
+
+    // custom commands kept in the buckets, the rest are scanned for
+    CMND_CUSTOM_MAX = 12
+};
+
+/**
+ * @typedef cmnd_custom
+ * @brief a custom command, as a slice of the device's valid_cmnds.
+ * len is 0 when the bucket is empty.
+ */
+typedef struct
+{
+    uint32_t hash;
+    unsigned char off;
+    unsigned char len;
+} cmnd_custom;
+
+/**
+ * @typedef cmnd_set
+ * @brief a device's valid commands, compiled from its valid_cmnds once
+ * so checking a command never scans them.
+ */
+typedef struct
+{
+    uint32_t known;
+    uint32_t relays;
+    int custom_count;
+    cmnd_custom custom[CMND_CUSTOM_LEN];
+} cmnd_set;
+
+/* prototypes */
+void cmnd_set_compile( cmnd_set *cs, const char *cmnds );
+int cmnd_set_has( const cmnd_set *cs, const char *cmnds, const char *input );
+
+#endif
@@ -59,6 +59,22 @@ static int ini_callback_handler( void* user, const char* section,
     {
         pconfig->buffer_size = atoi( value );
     }
+    else if ( MATCH(NETWORK, NETWORK_LEN, MAX_CLIENTS, MAX_CLIENTS_LEN) )
+    {
+        pconfig->max_clients = atoi( value );
+    }
+    else if ( MATCH(NETWORK, NETWORK_LEN, WORKERS, WORKERS_LEN) )
+    {
+        pconfig->workers = atoi( value );
+    }
+    else if ( MATCH(NETWORK, NETWORK_LEN, UNIX_SOCKET, UNIX_SOCKET_LEN) )
+    {
+        pconfig->unix_socket = strndup( value, strlen(value) );
+    }
+    else if ( MATCH(NETWORK, NETWORK_LEN, IDLE_TIMEOUT, IDLE_TIMEOUT_LEN) )
+    {
+        pconfig->idle_timeout = atoi( value );
+    }
     // Mqtt
     else if ( MATCH(MQTT, MQTT_LEN, MQTT_SRVR, MQTT_SRVR_LEN) )
     {
@@ -84,6 +100,22 @@ static int ini_callback_handler( void* user, const char* section,
     {
         pconfig->app_msg_buff = atoi( value );
     }
+    else if ( MATCH(MQTT, MQTT_LEN, STATE_BUF, STATE_BUF_LEN) )
+    {
+        pconfig->state_buff = atoi( value );
+    }
+    else if ( MATCH(MQTT, MQTT_LEN, COALESCE, COALESCE_LEN) )
+    {
+        pconfig->coalesce_delay = atoi( value );
+    }
+    else if ( MATCH(MQTT, MQTT_LEN, WILDCARD_SUB, WILDCARD_SUB_LEN) )
+    {
+        pconfig->wildcard_subscribe = atoi( value );
+    }
+    else if ( MATCH(MQTT, MQTT_LEN, WILDCARD_STAT, WILDCARD_STAT_LEN) )
+    {
+        pconfig->wildcard_state = atoi( value );
+    }
     // Database
     else if ( MATCH(DATABASE, DATABASE_LEN, DB_LOC, DB_LOC_LEN) )
     {
@@ -97,6 +129,18 @@ static int ini_callback_handler( void* user, const char* section,
     {
         pconfig->max_dev_count = atoi( value );
     }
+    else if ( MATCH(DATABASE, DATABASE_LEN, FLUSH_DELAY, FLUSH_DELAY_LEN) )
+    {
+        pconfig->flush_delay = atoi( value );
+    }
+    else if ( MATCH(DATABASE, DATABASE_LEN, DB_SYNC, DB_SYNC_LEN) )
+    {
+        pconfig->synchronous = atoi( value );
+    }
+    else if ( MATCH(DATABASE, DATABASE_LEN, DB_CACHE, DB_CACHE_LEN) )
+    {
+        pconfig->cache_size = atoi( value );
+    }
     // Default case
     else
     {
@@ -117,6 +161,20 @@ static int ini_callback_handler( void* user, const char* section,
  */
 int initialize_conf_parser( config *cfg )
 {
+    /* optional names fall back to these if the ini file omits them */
+    cfg->max_clients = MAX_CLIENTS_DEFAULT;
+    cfg->workers = WORKERS_DEFAULT;
+    cfg->unix_socket = NULL;
+    cfg->idle_timeout = IDLE_TIMEOUT_DEFAULT;
+    cfg->state_buff = STATE_BUFF_DEFAULT;
+    cfg->coalesce_delay = COALESCE_DEFAULT;
+    cfg->max_dev_count = MAX_DEV_COUNT_DEFAULT;
+    cfg->wildcard_subscribe = 0;
+    cfg->wildcard_state = 0;
+    cfg->flush_delay = FLUSH_DELAY_DEFAULT;
+    cfg->synchronous = DB_SYNC_DEFAULT;
+    cfg->cache_size = DB_CACHE_DEFAULT;
+
     if ( ini_parse( CONF_LOCATION, ini_callback_handler, cfg) < 0 )
     {
 
@@ -22,15 +22,26 @@
 // names
 #define PORT          ((const char *)"port")
 #define BUF_SIZE      ((const char *)"buffer_size")
+#define MAX_CLIENTS   ((const char *)"max_clients")
+#define WORKERS       ((const char *)"workers")
+#define UNIX_SOCKET   ((const char *)"unix_socket")
+#define IDLE_TIMEOUT  ((const char *)"idle_timeout")
 #define MQTT_SRVR     ((const char *)"mqtt_server")
 #define MQTT_PORT     ((const char *)"mqtt_port")
 #define RECV_BUF      ((const char *)"recv_buff")
 #define SND_BUF       ((const char *)"snd_buff")
 #define TPC_BUF       ((const char *)"topic_buff")
 #define MSG_BUF       ((const char *)"app_msg_buff")
+#define STATE_BUF     ((const char *)"state_buff")
+#define COALESCE      ((const char *)"coalesce_delay")
+#define WILDCARD_SUB  ((const char *)"wildcard_subscribe")
+#define WILDCARD_STAT ((const char *)"wildcard_state")
 #define DB_LOC        ((const char *)"db_location")
 #define DB_BUFF       ((const char *)"db_buff")
 #define MAX_DEV_COUNT ((const char *)"max_dev_count")
+#define FLUSH_DELAY   ((const char *)"flush_delay")
+#define DB_SYNC       ((const char *)"synchronous")
+#define DB_CACHE      ((const char *)"cache_size")
 
 enum {
 
@@ -42,15 +53,37 @@ enum {
     // name lens
     PORT_LEN = 5,
     BUF_SIZE_LEN = 12,
+    MAX_CLIENTS_LEN = 12,
+    WORKERS_LEN = 8,
+    UNIX_SOCKET_LEN = 12,
+    IDLE_TIMEOUT_LEN = 13,
     MQTT_SRVR_LEN = 12,
     MQTT_PORT_LEN = 10,
     RECV_BUF_LEN = 10,
     SND_BUF_LEN = 9,
     TPC_BUF_LEN = 11,
     MSG_BUF_LEN = 13,
+    STATE_BUF_LEN = 11,
+    COALESCE_LEN = 15,
+    WILDCARD_SUB_LEN = 19,
+    WILDCARD_STAT_LEN = 15,
     DB_LOC_LEN = 12,
     DB_BUF_LEN = 8,
-    MAX_DEV_COUNT_LEN = 14
+    MAX_DEV_COUNT_LEN = 14,
+    FLUSH_DELAY_LEN = 12,
+    DB_SYNC_LEN = 12,
+    DB_CACHE_LEN = 11,
+
+    // defaults for optional names
+    MAX_CLIENTS_DEFAULT = 1024,
+    WORKERS_DEFAULT = 1, // 0 is one per online cpu
+    IDLE_TIMEOUT_DEFAULT = 0, // in seconds, 0 never times out
+    STATE_BUFF_DEFAULT = 65536, // in bytes, rounded up to a power of 2
+    COALESCE_DEFAULT = 20, // in milliseconds, 0 applies states at once
+    MAX_DEV_COUNT_DEFAULT = 0, // 0 is only limited by the device table
+    FLUSH_DELAY_DEFAULT = 500, // in milliseconds
+    DB_SYNC_DEFAULT = 1, // NORMAL, safe with WAL
+    DB_CACHE_DEFAULT = -2000 // negative is in KiB, as sqlite does
 
 };
 
@@ -65,15 +98,26 @@ typedef struct
 {
     int port;
     int buffer_size;
+    int max_clients;
+    int workers;
+    const char *unix_socket;
+    int idle_timeout;
     const char *mqtt_server;
     int mqtt_port;
     int recv_buff;
     int snd_buff;
     int topic_buff;
     int app_msg_buff;
+    int state_buff;
+    int coalesce_delay;
+    int wildcard_subscribe;
+    int wildcard_state;
     const char *db_loc;
     int db_buff;
     int max_dev_count;
+    int flush_delay;
+    int synchronous;
+    int cache_size;
 } config;
 
 #endif
@@ -16,11 +16,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 // local includes
 #include "database.h"
 #include "config.h"
 #include "daemon.h"
+#include "hashindex.h"
 #include "inih/ini.h"
 
 #ifdef DEBUG
@@ -33,8 +35,7 @@ static config *conf;
 // pointers for database functions.
 static sqlite3 *db_ptr;
 static char *sql_buf;
-static db_data *memory;
-static char *dev_type_str;
+static db_table *memory;
 
 /*
  * global variable for a db counter,
@@ -42,11 +43,58 @@ static char *dev_type_str;
  */
 static int db_counter = 0;
 static int db_len = -1;
-static int *to_change;
+
+/*
+ * dev_name lookups go through this index,
+ * and free slots are handed out from a stack.
+ */
+static hash_index name_index;
+static int *free_slots = NULL;
+static int free_count = 0;
+
+/*
+ * the write queries, prepared once and
+ * finalized in close_db()
+ */
+static sqlite3_stmt *insert_stmt = NULL;
+static sqlite3_stmt *delete_stmt = NULL;
+static sqlite3_stmt *state_stmt = NULL;
+static sqlite3_stmt *name_stmt = NULL;
+static sqlite3_stmt *mqtt_stmt = NULL;
+
+/*
+ * slots with a pending to_change are queued here for db_updater(),
+ * a slot is queued at most once, so the table's capacity suffices.
+ */
+static int *dirty_slots = NULL;
+static char *is_dirty = NULL;
+static int dirty_count = 0;
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dirty_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * a queued device as take_db_changes() found it,
+ * along with what write_db_change() needs of its detail.
+ */
+typedef struct
+{
+    db_data dev;
+    state_table dev_state;
+    char odev_name[DB_DATA_LEN];
+    char omqtt_topic[DB_DATA_LEN];
+    char valid_cmnds[DB_CMND_LEN];
+} flush_row;
+
+/*
+ * db_updater() copies queued rows here while holding the lock,
+ * then writes them out after letting go of it.
+ */
+static flush_row *flush_rows = NULL;
+static int *flush_changes = NULL;
+static int flush_size = 0;
 
 // System pointers
-static pthread_mutex_t *lock;
-static sem_t *mutex;
+static pthread_rwlock_t *lock;
 
 /* Some function prototypes for future use */
 static int db_callback( void *data, int argc, char **argv, char **azColName );
@@ -64,6 +112,12 @@ static int update_db_dev_name( const char *odev_name, const char *ndev_name,
 static int update_db_mqtt_topic( const char *omqtt_topic,
                                  const char *nmqtt_topic,
                                  const char *dev_name );
+static int set_db_pragmas();
+static int prepare_db_statements();
+static int step_db_statement( sqlite3_stmt *stmt );
+static int take_db_changes();
+static void write_db_change( const flush_row *row, const int change );
+static void write_db_changes( const int count );
 
 /**
  * @brief Function to get current entry count
@@ -99,6 +153,201 @@ void increment_db_count()
     ++db_len;
 }
 
+/**
+ * @brief Find the slot of a device, given its name.
+ *
+ * @param dev_name the device name of interest, matched case-insensitively.
+ *
+ * @note Returns -1 if there is no such device, the slot otherwise.
+ * Only call when in the critical space of a semaphore.
+ */
+int get_device_slot( const char *dev_name )
+{
+    return hash_index_find( &name_index, dev_name, strlen(dev_name) );
+}
+
+/**
+ * @brief Add a slot's dev_name to the index, call after dev_name is set.
+ *
+ * @param slot the slot of interest.
+ *
+ * @note Returns 2 if the name is already taken, 1 upon any other error,
+ * returns 0 otherwise. Only call when in the critical space of a semaphore.
+ */
+int index_device_name( const int slot )
+{
+    return hash_index_insert( &name_index, DB_DEVICE(memory, slot)->dev_name,
+                              slot );
+}
+
+/**
+ * @brief Remove a dev_name from the index, call before dev_name changes.
+ *
+ * @param dev_name the device name to be removed.
+ *
+ * @note Only call when in the critical space of a semaphore.
+ */
+void unindex_device_name( const char *dev_name )
+{
+    hash_index_remove( &name_index, dev_name );
+}
+
+/**
+ * @brief Add a segment of empty slots to the end of the device table.
+ *
+ * @note Returns nonzero upon error, or if the table is as big as it gets.
+ * Only call when in the critical space of a semaphore.
+ */
+static int add_db_segment()
+{
+    int seg = memory->capacity / DB_SEGMENT_LEN;
+
+    if ( seg >= DB_SEGMENTS_MAX )
+    {
+        return 1;
+    }
+
+    db_data *devices = (db_data *)calloc( DB_SEGMENT_LEN, sizeof(db_data) );
+
+    if ( devices == NULL )
+    {
+        return 1;
+    }
+
+    for ( int i = 0; i < DB_SEGMENT_LEN; i++ )
+    {
+        devices[i].dev_type = -1;
+        devices[i].to_change = -1;
+    }
+
+    memory->segments[seg] = devices;
+    memory->capacity += DB_SEGMENT_LEN;
+
+    return 0;
+}
+
+/**
+ * @brief Grow the device table by a segment, along with
+ * every array kept per slot, and hand out its slots.
+ *
+ * @note Returns nonzero upon error. Only call when holding the
+ * lock exclusively.
+ */
+static int grow_db_table()
+{
+    int capacity = memory->capacity + DB_SEGMENT_LEN;
+
+    if ( capacity > DB_SEGMENTS_MAX * DB_SEGMENT_LEN )
+    {
+        return 1;
+    }
+
+    /* either array may already be this big, if growing failed before */
+    int *slots = (int *)realloc( free_slots, capacity * sizeof(int) );
+
+    if ( slots == NULL )
+    {
+        return 1;
+    }
+
+    free_slots = slots;
+
+    /* whoever queues or takes changes holds the lock too */
+    slots = (int *)realloc( dirty_slots, capacity * sizeof(int) );
+
+    if ( slots != NULL )
+    {
+        dirty_slots = slots;
+    }
+
+    char *dirty = (char *)realloc( is_dirty, capacity * sizeof(char) );
+
+    if ( dirty != NULL )
+    {
+        memset( dirty + memory->capacity, 0, DB_SEGMENT_LEN );
+        is_dirty = dirty;
+    }
+
+    if ( slots == NULL || dirty == NULL || add_db_segment() )
+    {
+        return 1;
+    }
+
+    /* lower slots are handed out first */
+    for ( int i = memory->capacity - 1; i >= capacity - DB_SEGMENT_LEN; i-- )
+    {
+        put_free_slot( i );
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Take a free slot for a new device, growing the device table
+ * if every slot is taken.
+ *
+ * @note Returns -1 if the maximum amount of devices is met, or the table
+ * could not grow, the slot otherwise. Only call when holding the lock
+ * exclusively.
+ */
+int get_free_slot()
+{
+    if ( conf->max_dev_count > 0 && db_len >= conf->max_dev_count )
+    {
+        return -1;
+    }
+
+    if ( free_count == 0 && grow_db_table() )
+    {
+#ifdef DEBUG
+        log_error( "Unable to grow the device table past %d slots",
+                   memory->capacity );
+#endif
+        return -1;
+    }
+
+    return free_slots[--free_count];
+}
+
+/**
+ * @brief Return a slot, once its device is removed from the database
+ * or if it was taken but not used.
+ *
+ * @param slot the slot that is free again.
+ *
+ * @note Only call when in the critical space of a semaphore.
+ */
+void put_free_slot( const int slot )
+{
+    free_slots[free_count++] = slot;
+}
+
+/**
+ * @brief Queue a slot whose to_change was just set, waking db_updater().
+ *
+ * @param slot the slot with a change to write out.
+ *
+ * @note Only call when in the critical space of a semaphore.
+ */
+void queue_db_change( const int slot )
+{
+    pthread_mutex_lock( &dirty_lock );
+
+    if ( !is_dirty[slot] )
+    {
+        is_dirty[slot] = 1;
+        dirty_slots[dirty_count++] = slot;
+
+        /* only the first change of a batch needs to wake the writer */
+        if ( dirty_count == 1 )
+        {
+            pthread_cond_signal( &dirty_cond );
+        }
+    }
+
+    pthread_mutex_unlock( &dirty_lock );
+}
+
 /**
  * @brief Function to verify device type.
  *
@@ -137,49 +386,39 @@ int check_device_type( const int in )
  *
  * @param in the Device ID to be passed in.
  *
- * @note returns the string created.
+ * @note returns a constant string, empty for an unknown ID, so it is
+ * safe to call from several readers at once.
  */
-char *device_type_to_str( const int in )
+const char *device_type_to_str( const int in )
 {
-    /* memset the dev_type_str buffer */
-    memset( dev_type_str, 0, DEV_TYPE_LEN );
-
     switch( in )
     {
         case 0:
-            strncpy( dev_type_str, DEV_TYPE0, DEV_TYPE0_LEN );
-            break;
+            return DEV_TYPE0;
 
         case 1:
-            strncpy( dev_type_str, DEV_TYPE1, DEV_TYPE1_LEN );
-            break;
+            return DEV_TYPE1;
 
         case 2:
-            strncpy( dev_type_str, DEV_TYPE2, DEV_TYPE2_LEN );
-            break;
+            return DEV_TYPE2;
 
         case 3:
-            strncpy( dev_type_str, DEV_TYPE3, DEV_TYPE3_LEN );
-            break;
+            return DEV_TYPE3;
 
         case 4:
-            strncpy( dev_type_str, DEV_TYPE4, DEV_TYPE4_LEN );
-            break;
+            return DEV_TYPE4;
 
         case 5:
-            strncpy( dev_type_str, DEV_TYPE5, DEV_TYPE5_LEN );
-            break;
+            return DEV_TYPE5;
 
         case 6:
-            strncpy( dev_type_str, DEV_TYPE6, DEV_TYPE6_LEN );
-            break;
+            return DEV_TYPE6;
 
         case 7:
-            strncpy( dev_type_str, DEV_TYPE7, DEV_TYPE7_LEN );
-            break;
+            return DEV_TYPE7;
     }
 
-    return dev_type_str;
+    return "";
 }
 
 /**
@@ -237,22 +476,48 @@ void powerstrip_cmnd_cat( char *dst, const int count )
     }
 }
 
+/**
+ * @brief Allocate the detail of a device, with an empty state
+ * and its valid commands compiled.
+ *
+ * @param valid_cmnds the valid commands, delimited by a comma. Anything
+ * past DB_CMND_LEN - 1 is cut off.
+ *
+ * @note Returns NULL upon error, free() it once the slot is freed.
+ */
+db_detail *new_db_detail( const char *valid_cmnds )
+{
+    int len = strnlen( valid_cmnds, DB_CMND_LEN - 1 );
+    db_detail *dd = (db_detail *)malloc( sizeof(db_detail) + len + 1 );
+
+    if ( dd == NULL )
+    {
+        return NULL;
+    }
+
+    init_dev_state( &dd->dev_state );
+    memset( dd->odev_name, 0, DB_DATA_LEN );
+    memset( dd->omqtt_topic, 0, DB_DATA_LEN );
+    memcpy( dd->valid_cmnds, valid_cmnds, len );
+    dd->valid_cmnds[len] = '\0';
+    cmnd_set_compile( &dd->cmnds, dd->valid_cmnds );
+
+    return dd;
+}
+
 /**
  * @brief Initialize everything for database thread usage.
  *
  * @param cfg the configuration struct for the server.
  * @param db the sqlite3 database pointer.
  * @param sql_buffer the buffer meant for sql statements.
- * @param dat the struct array for items in database.
- * @param to_chng the int array to indicate what may or may need to be changed.
- * @param lck the pthread mutex to prevent any race conditions.
- * @param mtx the semaphore mutex to also prevent any race conditions.
+ * @param tbl the device table, empty until the database is loaded into it.
+ * @param lck the device table's reader-writer lock.
  *
  * @note Returns nonzero upon error.
  */
-int initialize_db( config *cfg, sqlite3 *db, char *sql_buffer, db_data *dat,
-                   int *to_chng, char *dv_str, pthread_mutex_t *lck,
-                   sem_t *mtx )
+int initialize_db( config *cfg, sqlite3 *db, char *sql_buffer, db_table *tbl,
+                   pthread_rwlock_t *lck )
 {
     /*
      * establish a local pointer for sql_buffer,
@@ -261,16 +526,44 @@ int initialize_db( config *cfg, sqlite3 *db, char *sql_buffer, db_data *dat,
     conf = cfg;
     db_ptr = db;
     sql_buf = sql_buffer;
-    memory = dat;
-    to_change = to_chng;
-    dev_type_str = dv_str;
+    memory = tbl;
 
-    /* establish a local pointer for lock semaphore */
+    /* establish a local pointer for the device table lock */
     lock = lck;
-    mutex = mtx;
+
+    /* WAL, and how hard to sync, before touching anything */
+    int status = set_db_pragmas();
+
+    if ( status )
+    {
+#ifdef DEBUG
+        log_error( "Could not set database pragmas" );
+#endif
+        return 1;
+    }
+
+    /* compile the write queries once, up front */
+    status = prepare_db_statements();
+
+    if ( status )
+    {
+#ifdef DEBUG
+        log_error( "Could not prepare database statements" );
+#endif
+        return 1;
+    }
+
+    /* the first segment, the table grows from there as devices are added */
+    if ( add_db_segment() )
+    {
+#ifdef DEBUG
+        log_error( "Could not allocate the device table" );
+#endif
+        return 1;
+    }
 
     /* Get the count */
-    int status = get_db_len();
+    status = get_db_len();
 
     if ( status < 0 )
     {
@@ -286,7 +579,7 @@ int initialize_db( config *cfg, sqlite3 *db, char *sql_buffer, db_data *dat,
 #endif
     }
 
-    /* Migrate everything to memory */
+    /* Migrate everything to memory, the table grows to fit */
     status = dump_db_entries();
 
     if ( status )
@@ -303,10 +596,116 @@ int initialize_db( config *cfg, sqlite3 *db, char *sql_buffer, db_data *dat,
 #endif
     }
 
+    /* index what was loaded, and stack up the remaining slots */
+    int capacity = memory->capacity;
+
+    free_slots = (int *)malloc( capacity * sizeof(int) );
+    dirty_slots = (int *)malloc( capacity * sizeof(int) );
+    is_dirty = (char *)calloc( capacity, sizeof(char) );
+    flush_rows = (flush_row *)malloc( capacity * sizeof(flush_row) );
+    flush_changes = (int *)malloc( capacity * sizeof(int) );
+    flush_size = capacity;
+
+    if ( free_slots == NULL || dirty_slots == NULL || is_dirty == NULL
+      || flush_rows == NULL || flush_changes == NULL
+      || hash_index_init( &name_index, capacity ) )
+    {
+#ifdef DEBUG
+        log_error( "Could not allocate the device index" );
+#endif
+        return 1;
+    }
+
+    for ( int i = capacity - 1; i >= 0; i-- )
+    {
+        if ( DB_DEVICE(memory, i)->dev_name[0] == '\0' )
+        {
+            put_free_slot( i );
+        }
+        else if ( index_device_name( i ) )
+        {
+#ifdef DEBUG
+            log_warn( "Duplicate device name %s ignored",
+                      DB_DEVICE(memory, i)->dev_name );
+#endif
+        }
+    }
+
     return 0;
 
 }
 
+/**
+ * @brief Write out any queued changes, free the device index and
+ * close the database.
+ *
+ * @note Safe to call even if initialize_db() failed part way.
+ * db_updater() must no longer be running.
+ */
+void close_db()
+{
+    /* whatever db_updater() did not get to is written now */
+    while ( dirty_count > 0 )
+    {
+        write_db_changes( take_db_changes() );
+    }
+
+    free( dirty_slots );
+    free( is_dirty );
+    free( flush_rows );
+    free( flush_changes );
+    dirty_slots = NULL;
+    is_dirty = NULL;
+    flush_rows = NULL;
+    flush_changes = NULL;
+    flush_size = 0;
+    dirty_count = 0;
+
+    /* finalizing a NULL statement is a harmless no-op */
+    sqlite3_finalize( insert_stmt );
+    sqlite3_finalize( delete_stmt );
+    sqlite3_finalize( state_stmt );
+    sqlite3_finalize( name_stmt );
+    sqlite3_finalize( mqtt_stmt );
+    insert_stmt = NULL;
+    delete_stmt = NULL;
+    state_stmt = NULL;
+    name_stmt = NULL;
+    mqtt_stmt = NULL;
+
+    hash_index_free( &name_index );
+
+    free( free_slots );
+    free_slots = NULL;
+    free_count = 0;
+
+    sqlite3_close( db_ptr );
+    db_ptr = NULL;
+}
+
+/**
+ * @brief Free every device's detail, and the device table's segments.
+ *
+ * @param tbl the device table.
+ *
+ * @note Call once nothing uses the table anymore, close_db() included.
+ */
+void free_db_table( db_table *tbl )
+{
+    for ( int i = 0; i < tbl->capacity; i++ )
+    {
+        free( DB_DEVICE(tbl, i)->detail );
+    }
+
+    for ( int i = 0; i < tbl->capacity / DB_SEGMENT_LEN; i++ )
+    {
+        free( tbl->segments[i] );
+        tbl->segments[i] = NULL;
+    }
+
+    tbl->capacity = 0;
+}
+
 /**
  * @brief callback function for database access.
  *
@@ -321,11 +720,27 @@ int initialize_db( config *cfg, sqlite3 *db, char *sql_buffer, db_data *dat,
 static int db_callback( void *data, int argc, char **argv, char **azColName )
 {
     /* skip this request if there are too many devices */
-    if ( db_counter == conf->max_dev_count )
+    if ( conf->max_dev_count > 0 && db_counter == conf->max_dev_count )
     {
         return 0;
     }
 
+    /* or grow the table to make room for it */
+    if ( db_counter == memory->capacity && add_db_segment() )
+    {
+#ifdef DEBUG
+        log_error( "Unable to grow the device table past %d slots",
+                   memory->capacity );
+#endif
+        return 0;
+    }
+
+    db_data *dev = DB_DEVICE(memory, db_counter);
+
+    /* the detail is sized by valid_cmnds, so it is filled in last */
+    const char *state = NULL;
+    const char *cmnds = NULL;
+
     for ( int i = 0; i < argc; i++ )
     {
         // temporary variable
@@ -333,27 +748,25 @@ static int db_callback( void *data, int argc, char **argv, char **azColName )
 
         if ( strncmp(azColName[i], DEV_NAME, DEV_NAME_LEN) == 0  )
         {
-            strncpy( memory[db_counter].dev_name, argv[i],
+            strncpy( dev->dev_name, argv[i],
             (argv_len < DB_DATA_LEN) ? argv_len : DB_DATA_LEN );
         }
         else if ( strncmp(azColName[i], MQTT_TPC, MQTT_TPC_LEN) == 0 )
         {
-            strncpy( memory[db_counter].mqtt_topic, argv[i],
+            strncpy( dev->mqtt_topic, argv[i],
             (argv_len < DB_DATA_LEN) ? argv_len : DB_DATA_LEN );
         }
         else if ( strncmp(azColName[i], DEV_TYPE, DV_TYPE_LEN) == 0 )
         {
-            memory[db_counter].dev_type = atoi( argv[i] );
+            dev->dev_type = atoi( argv[i] );
         }
         else if ( strncmp(azColName[i], DEV_STATE, DEV_STATE_LEN) == 0 )
         {
-            strncpy( memory[db_counter].dev_state, argv[i],
-            (argv_len < DV_STATE_LEN) ? argv_len : DV_STATE_LEN );
+            state = argv[i];
         }
        else if ( strncmp(azColName[i], VLD_CMDS, VLD_CMDS_LEN) == 0 )
        {
-           strncpy( memory[db_counter].valid_cmnds, argv[i],
-           (argv_len < DB_CMND_LEN) ? argv_len : DB_CMND_LEN );
+           cmnds = argv[i];
        }
        // a special case to get the count
        else if ( strncmp(azColName[i], COUNT, COUNT_LEN) == 0 )
@@ -362,8 +775,10 @@ static int db_callback( void *data, int argc, char **argv, char **azColName )
            db_len = atoi( argv[i] );
 
            /* though make sure to ignore subsequent entries if needed */
-           db_len = (db_len > conf->max_dev_count) ?
-                     conf->max_dev_count : db_len;
+           if ( conf->max_dev_count > 0 && db_len > conf->max_dev_count )
+           {
+               db_len = conf->max_dev_count;
+           }
        }
        else
        {
@@ -373,6 +788,33 @@ static int db_callback( void *data, int argc, char **argv, char **azColName )
        }
     }
 
+    /* the count has no dev_name, nor does it take up a slot */
+    if ( dev->dev_name[0] == '\0' )
+    {
+        return 0;
+    }
+
+    dev->detail = new_db_detail( cmnds != NULL ? cmnds : "" );
+
+    if ( dev->detail == NULL )
+    {
+#ifdef DEBUG
+        log_error( "No memory for device %s, ignoring it", dev->dev_name );
+#endif
+        /* the slot is left free instead */
+        memset( dev->dev_name, 0, DB_DATA_LEN );
+        memset( dev->mqtt_topic, 0, DB_DATA_LEN );
+        dev->dev_type = -1;
+
+        return 0;
+    }
+
+    if ( state != NULL )
+    {
+        merge_dev_state( &dev->detail->dev_state, state, strlen(state),
+                         NULL );
+    }
+
     db_counter++;
 
     return 0;
@@ -507,27 +949,14 @@ static int insert_db_entry( const char *dev_name, const char *mqtt_topic,
         return 2;
     }
 
-    /* make sure there is room for more devices */
-    if ( db_len >= conf->max_dev_count )
-    {
-#ifdef DEBUG
-    log_error( "Max devices already reached, ignoring this insert request" );
-#endif
-        return 3;
-    }
-
     /* Now to do the actual insertion */
-    int dv_nm_len = strlen( dev_name );
-    int mqtt_tpc_len = strlen( mqtt_topic );
-    int type_len = get_digit_count( type );
-    int state_len = strlen( state );
-    int vld_cmds_len = strlen( valid_commands );
+    sqlite3_bind_text( insert_stmt, 1, dev_name, -1, SQLITE_STATIC );
+    sqlite3_bind_text( insert_stmt, 2, mqtt_topic, -1, SQLITE_STATIC );
+    sqlite3_bind_int( insert_stmt, 3, type );
+    sqlite3_bind_text( insert_stmt, 4, state, -1, SQLITE_STATIC );
+    sqlite3_bind_text( insert_stmt, 5, valid_commands, -1, SQLITE_STATIC );
 
-    snprintf( sql_buf, (INSERT_QUERY_LEN + dv_nm_len + mqtt_tpc_len +
-              type_len + state_len + vld_cmds_len), INSERT_QUERY, dev_name,
-              mqtt_topic, type, state, valid_commands );
-
-    int db_ret = execute_db_query( sql_buf );
+    int db_ret = step_db_statement( insert_stmt );
 
     if ( !db_ret )
     {
@@ -536,9 +965,6 @@ static int insert_db_entry( const char *dev_name, const char *mqtt_topic,
 #endif
     }
 
-     /* memset the sql buffer */
-    memset( sql_buf, 0, conf->db_buff );
-
     return db_ret;
 }
 
@@ -552,13 +978,10 @@ static int insert_db_entry( const char *dev_name, const char *mqtt_topic,
  */
 static int delete_db_entry( const char *dev_name, const char *mqtt_topic )
 {
-    int dev_nm_len = strlen( dev_name );
-    int mqtt_tpc_len = strlen( mqtt_topic );
-
-    snprintf( sql_buf, (DELETE_QUERY_LEN + dev_nm_len + mqtt_tpc_len),
-              DELETE_QUERY, dev_name, mqtt_topic );
+    sqlite3_bind_text( delete_stmt, 1, dev_name, -1, SQLITE_STATIC );
+    sqlite3_bind_text( delete_stmt, 2, mqtt_topic, -1, SQLITE_STATIC );
 
-    int db_ret = execute_db_query( sql_buf );
+    int db_ret = step_db_statement( delete_stmt );
 
     if ( !db_ret )
     {
@@ -567,9 +990,6 @@ static int delete_db_entry( const char *dev_name, const char *mqtt_topic )
 #endif
     }
 
-     /* memset the sql buffer */
-    memset( sql_buf, 0, conf->db_buff );
-
     return db_ret;
 }
 
@@ -586,14 +1006,11 @@ static int delete_db_entry( const char *dev_name, const char *mqtt_topic )
 static int update_db_dev_state( const char *dev_name, const char *mqtt_topic,
                                 const char *state )
 {
-    int dv_nm_len = strlen( dev_name );
-    int mqtt_tpc_len = strlen( mqtt_topic );
-    int state_len = strlen( state );
+    sqlite3_bind_text( state_stmt, 1, state, -1, SQLITE_STATIC );
+    sqlite3_bind_text( state_stmt, 2, dev_name, -1, SQLITE_STATIC );
+    sqlite3_bind_text( state_stmt, 3, mqtt_topic, -1, SQLITE_STATIC );
 
-    snprintf( sql_buf, (STATE_QUERY_LEN + dv_nm_len + mqtt_tpc_len +
-              state_len), STATE_QUERY, state, dev_name, mqtt_topic );
-
-    int db_ret = execute_db_query( sql_buf );
+    int db_ret = step_db_statement( state_stmt );
 
     if ( !db_ret )
     {
@@ -602,9 +1019,6 @@ static int update_db_dev_state( const char *dev_name, const char *mqtt_topic,
 #endif
     }
 
-     /* memset the sql buffer */
-    memset( sql_buf, 0, conf->db_buff );
-
     return db_ret;
 }
 
@@ -621,14 +1035,11 @@ static int update_db_dev_state( const char *dev_name, const char *mqtt_topic,
 static int update_db_dev_name( const char *odev_name, const char *ndev_name,
                                const char *mqtt_topic )
 {
-    int odev_name_len = strlen( odev_name );
-    int ndev_name_len = strlen( ndev_name );
-    int mqtt_tpc_len = strlen( mqtt_topic );
-
-    snprintf( sql_buf, (NAME_QUERY_LEN + odev_name_len + mqtt_tpc_len +
-              ndev_name_len), NAME_QUERY, ndev_name, odev_name, mqtt_topic );
+    sqlite3_bind_text( name_stmt, 1, ndev_name, -1, SQLITE_STATIC );
+    sqlite3_bind_text( name_stmt, 2, odev_name, -1, SQLITE_STATIC );
+    sqlite3_bind_text( name_stmt, 3, mqtt_topic, -1, SQLITE_STATIC );
 
-    int db_ret = execute_db_query( sql_buf );
+    int db_ret = step_db_statement( name_stmt );
 
     if ( !db_ret )
     {
@@ -638,9 +1049,6 @@ static int update_db_dev_name( const char *odev_name, const char *ndev_name,
 #endif
     }
 
-     /* memset the sql buffer */
-    memset( sql_buf, 0, conf->db_buff );
-
     return db_ret;
 }
 
@@ -658,14 +1066,11 @@ static int update_db_mqtt_topic( const char *omqtt_topic,
                                  const char *nmqtt_topic,
                                  const char *dev_name )
 {
-    int omqtt_tpc_len = strlen( omqtt_topic );
-    int nmqtt_tpc_len = strlen( nmqtt_topic );
-    int dev_name_len = strlen( dev_name );
-
-    snprintf( sql_buf, (MQTT_QUERY_LEN + omqtt_tpc_len + nmqtt_tpc_len +
-              dev_name_len), MQTT_QUERY, nmqtt_topic, dev_name, omqtt_topic );
+    sqlite3_bind_text( mqtt_stmt, 1, nmqtt_topic, -1, SQLITE_STATIC );
+    sqlite3_bind_text( mqtt_stmt, 2, dev_name, -1, SQLITE_STATIC );
+    sqlite3_bind_text( mqtt_stmt, 3, omqtt_topic, -1, SQLITE_STATIC );
 
-    int db_ret = execute_db_query( sql_buf );
+    int db_ret = step_db_statement( mqtt_stmt );
 
     if ( !db_ret )
     {
@@ -675,147 +1080,417 @@ static int update_db_mqtt_topic( const char *omqtt_topic,
 #endif
     }
 
-     /* memset the sql buffer */
+    return db_ret;
+}
+
+/**
+ * @brief Put the database in WAL mode, and apply the configured
+ * synchronous and cache_size pragmas.
+ *
+ * @note Returns nonzero upon error.
+ */
+static int set_db_pragmas()
+{
+    int rv = 0;
+    char *errmsg = 0;
+
+    /* the pragmas return rows, which db_callback() has no use for */
+    int status = sqlite3_exec( db_ptr, WAL_QUERY, NULL, 0, &errmsg );
+
+    if ( status == SQLITE_OK )
+    {
+        snprintf( sql_buf, SYNC_QUERY_LEN + get_digit_count(conf->synchronous),
+                  SYNC_QUERY, conf->synchronous );
+        status = sqlite3_exec( db_ptr, sql_buf, NULL, 0, &errmsg );
+    }
+
+    if ( status == SQLITE_OK )
+    {
+        /* room for a sign as well */
+        snprintf( sql_buf, CACHE_QUERY_LEN + 1 +
+                  get_digit_count(conf->cache_size),
+                  CACHE_QUERY, conf->cache_size );
+        status = sqlite3_exec( db_ptr, sql_buf, NULL, 0, &errmsg );
+    }
+
+    if ( status != SQLITE_OK )
+    {
+#ifdef DEBUG
+        log_warn( "sql error: %s", errmsg );
+        printf( "full query: \n%s\n", sql_buf );
+#endif
+
+        sqlite3_free( errmsg );
+        rv = 1;
+    }
+
+    /* memset the sql buffer */
     memset( sql_buf, 0, conf->db_buff );
 
-    return db_ret;
+    return rv;
 }
 
 /**
- * @brief the data refresher which updates database
- * at every roughly 5 seconds, if there is
- * a change to be made of course.
+ * @brief Compile the insert, delete and update queries.
+ *
+ * @note Returns nonzero upon error. Whatever was prepared
+ * is finalized by close_db() either way.
+ */
+static int prepare_db_statements()
+{
+    const char *queries[] = { INSERT_QUERY, DELETE_QUERY, STATE_QUERY,
+                              NAME_QUERY, MQTT_QUERY };
+    const int lens[] = { INSERT_QUERY_LEN, DELETE_QUERY_LEN, STATE_QUERY_LEN,
+                         NAME_QUERY_LEN, MQTT_QUERY_LEN };
+    sqlite3_stmt **stmts[] = { &insert_stmt, &delete_stmt, &state_stmt,
+                               &name_stmt, &mqtt_stmt };
+
+    for ( int i = 0; i < 5; i++ )
+    {
+        if ( sqlite3_prepare_v2( db_ptr, queries[i], lens[i], stmts[i],
+                                 NULL ) != SQLITE_OK )
+        {
+#ifdef DEBUG
+            log_error( "sql error: %s", sqlite3_errmsg(db_ptr) );
+            printf( "full query: \n%s\n", queries[i] );
+#endif
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Run a prepared statement with its bound values,
+ * then reset it for the next call.
+ *
+ * @param stmt the statement, with its values already bound.
+ *
+ * @note Returns nonzero upon error.
+ */
+static int step_db_statement( sqlite3_stmt *stmt )
+{
+    int rv = 0;
+
+    if ( sqlite3_step( stmt ) != SQLITE_DONE )
+    {
+#ifdef DEBUG
+        log_warn( "sql error: %s", sqlite3_errmsg(db_ptr) );
+        printf( "full query: \n%s\n", sqlite3_sql(stmt) );
+#endif
+        rv = 1;
+    }
+#ifdef DEBUG
+    else
+    {
+        log_debug( "Succesfully ran query '%s' to database",
+                   sqlite3_sql(stmt) );
+    }
+#endif
+
+    /* the bound strings belong to the caller, drop them */
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+
+    return rv;
+}
+
+/**
+ * @brief Take the queued changes out of memory, for writing later.
+ *
+ * @note Each queued slot is copied to flush_rows, with its to_change in
+ * flush_changes, and memory is reset as if it were already written, so
+ * requests carry on while the batch goes to disk. Returns the amount of
+ * rows taken. Only call when holding the lock exclusively.
+ */
+static int take_db_changes()
+{
+    int count = 0;
+    int taken = 0;
+
+    pthread_mutex_lock( &dirty_lock );
+
+    /* only db_updater() uses these, and the table may have grown */
+    if ( dirty_count > flush_size )
+    {
+        flush_row *rows = (flush_row *)realloc(
+            flush_rows, dirty_count * sizeof(flush_row)
+        );
+        int *changes = (int *)realloc(
+            flush_changes, dirty_count * sizeof(int)
+        );
+
+        flush_rows = rows != NULL ? rows : flush_rows;
+        flush_changes = changes != NULL ? changes : flush_changes;
+
+        if ( rows != NULL && changes != NULL )
+        {
+            flush_size = dirty_count;
+        }
+    }
+
+    /* short on memory, so the rest wait for the next batch */
+    for ( ; taken < dirty_count && count < flush_size; taken++ )
+    {
+        int slot = dirty_slots[taken];
+        db_data *dev = DB_DEVICE(memory, slot);
+        int change = dev->to_change;
+
+        is_dirty[slot] = 0;
+
+        /* nothing left to do, likely taken already */
+        if ( change < 0 )
+        {
+            continue;
+        }
+
+        flush_row *row = &flush_rows[count];
+        db_detail *dd = dev->detail;
+
+        memcpy( &row->dev, dev, sizeof(db_data) );
+        flush_changes[count++] = change;
+
+        /* only inserts and state updates write the state */
+        if ( change == 0 || change == 3 || change == 4 )
+        {
+            memcpy( &row->dev_state, &dd->dev_state, sizeof(state_table) );
+        }
+
+        if ( change == 4 )
+        {
+            memcpy( row->valid_cmnds, dd->valid_cmnds,
+                    strlen(dd->valid_cmnds) + 1 );
+        }
+
+        /* old names are only needed until this batch is written */
+        if ( change != 0 )
+        {
+            memcpy( row->odev_name, dd->odev_name, DB_DATA_LEN );
+            memcpy( row->omqtt_topic, dd->omqtt_topic, DB_DATA_LEN );
+            memset( dd->odev_name, 0, DB_DATA_LEN );
+            memset( dd->omqtt_topic, 0, DB_DATA_LEN );
+        }
+
+        if ( change == 5 )
+        {
+            /*
+             * dev_name and mqtt topic already reset, so
+             * reset the reset the rest for later use.
+             */
+            dev->dev_type = -1;
+            dev->detail = NULL;
+            free( dd );
+
+            /*
+             * the slot can be reused now, batches are written in order
+             * so its delete lands before any insert into it.
+             */
+            put_free_slot( slot );
+        }
+
+        /* reset to_change */
+        dev->to_change = -1;
+    }
+
+    dirty_count -= taken;
+    memmove( dirty_slots, dirty_slots + taken, dirty_count * sizeof(int) );
+
+    pthread_mutex_unlock( &dirty_lock );
+
+    return count;
+}
+
+/**
+ * @brief Write a staged change to the database.
+ *
+ * @param row the device, as it was when the change was taken.
+ * @param change the to_change value that was staged for it.
+ */
+static void write_db_change( const flush_row *row, const int change )
+{
+    char state[DV_STATE_LEN];
+    const db_data *dev = &row->dev;
+
+    /* only inserts and state updates need the state as json */
+    if ( change == 0 || change == 3 || change == 4 )
+    {
+        dev_state_to_json( state, DV_STATE_LEN, &row->dev_state );
+    }
+
+    switch( change )
+    {
+        // Update the row's dev_state
+        case 0:
+        {
+            update_db_dev_state( dev->dev_name, dev->mqtt_topic, state );
+            break;
+        }
+
+        // Update the row's dev_name
+        case 1:
+        {
+            update_db_dev_name( row->odev_name, dev->dev_name,
+                                dev->mqtt_topic );
+            break;
+        }
+
+        // Update the row's mqtt_topic
+        case 2:
+        {
+            update_db_mqtt_topic( row->omqtt_topic, dev->mqtt_topic,
+                                  dev->dev_name );
+            break;
+        }
+
+        // Update all (makes it easier)
+        case 3:
+        {
+            /* Update the dev_mame, the row still has the old topic */
+            update_db_dev_name( row->odev_name, dev->dev_name,
+                                row->omqtt_topic );
+
+            /* Update the mqtt_topic */
+            update_db_mqtt_topic( row->omqtt_topic, dev->mqtt_topic,
+                                  dev->dev_name );
+
+            /* Finally update the dev_state */
+            update_db_dev_state( dev->dev_name, dev->mqtt_topic, state );
+            break;
+        }
+
+        // Add the new device, renames before the insert are covered by it
+        case 4:
+        {
+            insert_db_entry( dev->dev_name, dev->mqtt_topic, dev->dev_type,
+                             state, row->valid_cmnds );
+            break;
+        }
+
+        // remove the device
+        case 5:
+        {
+            delete_db_entry( row->odev_name, row->omqtt_topic );
+            break;
+        }
+
+        default:
+        {
+#ifdef DEBUG
+            log_warn( "default case reached, unknown option %d", change );
+#endif
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Write the taken changes in a single transaction.
+ *
+ * @param count the amount of rows take_db_changes() returned.
+ *
+ * @note One commit means one sync for the whole batch, rather than one
+ * per statement. Needs no lock, only db_updater() (or close_db() once
+ * it is gone) writes to the database.
+ */
+static void write_db_changes( const int count )
+{
+    /* a transaction left open by a failed commit is reused */
+    if ( sqlite3_get_autocommit( db_ptr ) )
+    {
+        execute_db_query( BEGIN_QUERY );
+    }
+
+    for ( int i = 0; i < count; i++ )
+    {
+        write_db_change( &flush_rows[i], flush_changes[i] );
+    }
+
+    /* if BEGIN failed, every statement already committed by itself */
+    if ( !sqlite3_get_autocommit( db_ptr )
+      && execute_db_query( COMMIT_QUERY ) )
+    {
+#ifdef DEBUG
+        log_error( "Unable to commit %d changes", count );
+#endif
+    }
+}
+
+/**
+ * @brief cancellation cleanup for db_updater(), as a cancelled
+ * pthread_cond_wait() returns with the mutex held.
+ */
+static void unlock_dirty( void *mtx )
+{
+    pthread_mutex_unlock( (pthread_mutex_t *)mtx );
+}
+
+/**
+ * @brief the data refresher which writes queued changes to the database.
  *
  * @param args is not used atm.
+ *
+ * @note Sleeps on a condition variable until a change is queued, then
+ * lets more changes join the batch for as long as they keep coming,
+ * flushing once DB_FLUSH_QUIET milliseconds pass without one, or
+ * flush_delay milliseconds after the first.
  */
 void *db_updater( void* args )
 {
-    /* sleep for 5 seconds initially */
-    usleep( 100000 * 50 );
+    int count;
+    int cancel_state;
 
     while( 1 )
     {
-        sem_wait( mutex );
-        pthread_mutex_lock( lock );
+        /* nothing to do until something is queued */
+        pthread_mutex_lock( &dirty_lock );
+        pthread_cleanup_push( unlock_dirty, &dirty_lock );
 
-        for ( int i = 0; i < conf->max_dev_count; i++ )
+        while ( dirty_count == 0 )
         {
-            /* just skip if there are no changes to make. */
-            if ( to_change[i] < 0 )
-            {
-                continue;
-            }
+            pthread_cond_wait( &dirty_cond, &dirty_lock );
+        }
+
+        count = dirty_count;
+        pthread_cleanup_pop( 1 );
+
+        /* let more changes join this batch, until they stop coming */
+        for ( int waited = 0; waited < conf->flush_delay; )
+        {
+            int ms = conf->flush_delay - waited;
+            ms = ( ms < DB_FLUSH_QUIET ) ? ms : DB_FLUSH_QUIET;
+
+            struct timespec quiet = {
+                .tv_sec = ms / 1000,
+                .tv_nsec = ( ms % 1000 ) * 1000000L
+            };
+
+            nanosleep( &quiet, NULL );
+            waited += ms;
 
-            switch( to_change[i] )
+            pthread_mutex_lock( &dirty_lock );
+            int grown = dirty_count != count;
+            count = dirty_count;
+            pthread_mutex_unlock( &dirty_lock );
+
+            if ( !grown )
             {
-                // Update i's dev_state
-                case 0:
-                {
-                    update_db_dev_state( memory[i].dev_name,
-                                         memory[i].mqtt_topic,
-                                         memory[i].dev_state );
-
-                    /* nothing to reset, so continue */
-                    break;
-                }
-
-                // Update i's dev_name
-                case 1:
-                {
-                    update_db_dev_name( memory[i].odev_name,
-                                        memory[i].dev_name,
-                                        memory[i].mqtt_topic );
-
-                    /* reset for later use */
-                    memset( memory[i].odev_name, 0, DB_DATA_LEN );
-
-                    break;
-                }
-
-                // Update i's mqtt_topic
-                case 2:
-                {
-                    update_db_mqtt_topic( memory[i].omqtt_topic,
-                                          memory[i].mqtt_topic,
-                                          memory[i].dev_name );
-                    /* reset for later use */
-                    memset( memory[i].omqtt_topic, 0, DB_DATA_LEN );
-
-                    break;
-                }
-
-                // Update all (makes it easier)
-                case 3:
-                {
-                    /* Update the dev_mame */
-                    update_db_dev_name( memory[i].odev_name,
-                                        memory[i].dev_name,
-                                        memory[i].mqtt_topic );
-
-                    /* Update the mqtt_topic */
-                    update_db_mqtt_topic( memory[i].omqtt_topic,
-                                          memory[i].mqtt_topic,
-                                          memory[i].dev_name );
-
-                    /* Finally update the dev_state */
-                    update_db_dev_state( memory[i].dev_name,
-                                         memory[i].mqtt_topic,
-                                         memory[i].dev_state );
-
-                    /* reset for later use */
-                    memset( memory[i].odev_name, 0, DB_DATA_LEN );
-                    memset( memory[i].omqtt_topic, 0, DB_DATA_LEN );
-
-                    break;
-                }
-
-                // Add new device that's in i
-                case 4:
-                {
-                    insert_db_entry( memory[i].dev_name, memory[i].mqtt_topic,
-                                     memory[i].dev_type, memory[i].dev_state,
-                                     memory[i].valid_cmnds );
-
-                    break;
-                }
-
-                // remove i's device
-                case 5:
-                {
-                    delete_db_entry( memory[i].odev_name,
-                                     memory[i].omqtt_topic );
-
-                    /*
-                     * dev_name and mqtt topic already reset, so
-                     * reset the reset the rest for later use.
-                     */
-                    memory[i].dev_type = -1;
-                    memset( memory[i].dev_state, 0, DV_STATE_LEN );
-                    memset( memory[i].valid_cmnds, 0, DB_CMND_LEN );
-                    memset( memory[i].odev_name, 0, DB_DATA_LEN );
-                    memset( memory[i].omqtt_topic, 0, DB_DATA_LEN );
-
-                    break;
-                }
-
-                default:
-                {
-#ifdef DEBUG
-                    log_warn( "default case reached, unknown option %d",
-                               to_change[i] );
-#endif
-                    break;
-                }
+                break;
             }
-
-            /* reset to_change */
-            to_change[i] = -1;
         }
 
-        pthread_mutex_unlock( lock );
-        sem_post( mutex );
+        /* a batch is written whole, so hold off on being cancelled */
+        pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, &cancel_state );
 
-        /* sleep for specified amount of time */
-        usleep( 100000 * 10 * SLEEP_DELAY );
+        /* only hold the lock while copying, not while writing */
+        pthread_rwlock_wrlock( lock );
+        count = take_db_changes();
+        pthread_rwlock_unlock( lock );
+
+        write_db_changes( count );
+
+        pthread_setcancelstate( cancel_state, NULL );
     }
+
+    return NULL;
 }
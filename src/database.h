@@ -13,9 +13,10 @@
 
 /* Includes in case the compiler complains */
 #include <pthread.h>
-#include <semaphore.h>
 #include "sqlite3/sqlite3.h"
 #include "config.h"
+#include "statejson.h"
+#include "cmndset.h"
 
 /* Useful constants regarding database reside here */
 
@@ -58,32 +59,44 @@
 #define GET_LEN_QUERY ((const char *)"SELECT COUNT(*) FROM device;")
 #define DB_DUMP_QUERY ((const char *)"SELECT dev_name, mqtt_topic, " \
 "dev_type, dev_state, valid_cmnds FROM device;")
-#define INSERT_QUERY  ((const char *)"INSERT INTO device VALUES('%s'," \
-" '%s', %d, '%s', '%s');")
-#define DELETE_QUERY  ((const char *)"DELETE FROM device WHERE dev_name" \
-"='%s' AND mqtt_topic='%s';")
-
-/* Update queries */
-#define STATE_QUERY   ((const char *)"UPDATE device SET dev_state='%s' WHERE"\
-" dev_name='%s' AND mqtt_topic='%s';")
-#define NAME_QUERY    ((const char *)"UPDATE device SET dev_name='%s' WHERE"\
-" dev_name='%s' AND mqtt_topic='%s';")
-#define MQTT_QUERY    ((const char *)"UPDATE device SET mqtt_topic='%s' "\
-"WHERE dev_name='%s' AND mqtt_topic='%s';")
+/*
+ * Prepared once in initialize_db(), values are bound on each call
+ */
+#define INSERT_QUERY  ((const char *)"INSERT INTO device VALUES(?1, ?2, ?3, "\
+"?4, ?5);")
+#define DELETE_QUERY  ((const char *)"DELETE FROM device WHERE dev_name=?1 "\
+"AND mqtt_topic=?2;")
+
+/* Transaction and setup queries */
+#define BEGIN_QUERY   ((const char *)"BEGIN;")
+#define COMMIT_QUERY  ((const char *)"COMMIT;")
+#define WAL_QUERY     ((const char *)"PRAGMA journal_mode=WAL;")
+#define SYNC_QUERY    ((const char *)"PRAGMA synchronous=%d;")
+#define CACHE_QUERY   ((const char *)"PRAGMA cache_size=%d;")
+
+/* Update queries, also prepared */
+#define STATE_QUERY   ((const char *)"UPDATE device SET dev_state=?1 WHERE "\
+"dev_name=?2 AND mqtt_topic=?3;")
+#define NAME_QUERY    ((const char *)"UPDATE device SET dev_name=?1 WHERE "\
+"dev_name=?2 AND mqtt_topic=?3;")
+#define MQTT_QUERY    ((const char *)"UPDATE device SET mqtt_topic=?1 WHERE "\
+"dev_name=?2 AND mqtt_topic=?3;")
 
 enum {
     DB_DATA_LEN = 64,
     DB_CMND_LEN = 256,
 
-    /* For the device id
-     * to string function.
-     *
-     * Also used in main.
-     */
-    DEV_TYPE_LEN = 64,
+    // the device table grows this many slots at a time
+    DB_SEGMENT_LEN = 64,
+
+    // so it holds at most DB_SEGMENTS_MAX * DB_SEGMENT_LEN devices
+    DB_SEGMENTS_MAX = 1024,
 
     DV_STATE_LEN = 1024,
 
+    // db_updater() flushes once no change arrives for this many ms
+    DB_FLUSH_QUIET = 50,
+
     // dev type lens
     DEV_TYPE0_LEN = 18,
     DEV_TYPE1_LEN = 11,
@@ -120,34 +133,37 @@ enum {
 
     // query lens
     /* NOTE:
-     * Placeholder parts of strings are
-     * not included in length,
-     * hence the differences in length
+     * printf placeholder parts of strings are
+     * not included in length, hence the differences
+     * in length. Prepared queries are full length.
      */
     GET_LEN_QUERY_LEN = 29,
     DB_DUMP_QUERY_LEN = 75,
-    INSERT_QUERY_LEN = 45,
+    INSERT_QUERY_LEN = 47,
     DELETE_QUERY_LEN = 56,
     STATE_QUERY_LEN = 68,
     NAME_QUERY_LEN = 67,
     MQTT_QUERY_LEN = 69,
-
-    // Seconds to sleep
-    SLEEP_DELAY = 5U,
+    BEGIN_QUERY_LEN = 7,
+    COMMIT_QUERY_LEN = 8,
+    WAL_QUERY_LEN = 25,
+    SYNC_QUERY_LEN = 21,
+    CACHE_QUERY_LEN = 20,
 
 };
 
 /**
- * @typedef db_data
- * @brief database output struct
+ * @typedef db_detail
+ * @brief the parts of a device only looked at once it is found,
+ * allocated per device to fit its valid_cmnds.
  */
 typedef struct
 {
-    char dev_name[DB_DATA_LEN];
-    char mqtt_topic[DB_DATA_LEN];
-    int dev_type;
-    char dev_state[DV_STATE_LEN];
-    char valid_cmnds[DB_CMND_LEN];
+    /* serialized to json only when written or sent */
+    state_table dev_state;
+
+    /* valid_cmnds compiled, to check commands against */
+    cmnd_set cmnds;
 
     /*
      * for database usage,
@@ -156,21 +172,70 @@ typedef struct
     char odev_name[DB_DATA_LEN];
     char omqtt_topic[DB_DATA_LEN];
 
+    /* delimited by a comma, at most DB_CMND_LEN with its terminator */
+    char valid_cmnds[];
+
+} db_detail;
+
+/**
+ * @typedef db_data
+ * @brief database output struct, kept small as the whole
+ * device table is walked by LIST and the like.
+ */
+typedef struct
+{
+    char dev_name[DB_DATA_LEN];
+    char mqtt_topic[DB_DATA_LEN];
+    int dev_type;
+
+    /* the change staged for db_updater(), -1 for none */
+    int to_change;
+
+    /* bumped whenever the device or its detail changes, for cached responses */
+    unsigned int version;
+
+    /* NULL while the slot is free */
+    db_detail *detail;
+
 } db_data;
 
+/**
+ * @typedef db_table
+ * @brief every device slot, allocated DB_SEGMENT_LEN slots at a time.
+ * A segment is never moved or freed until exit, so neither are its devices.
+ */
+typedef struct
+{
+    db_data *segments[DB_SEGMENTS_MAX];
+    int capacity;
+} db_table;
+
+/* a slot's device, the slot must be below the table's capacity */
+#define DB_DEVICE(tbl, slot) \
+    (&(tbl)->segments[(slot) / DB_SEGMENT_LEN][(slot) % DB_SEGMENT_LEN])
+
 
 /* Prototypes for various functions */
-int initialize_db( config *cfg, sqlite3 *db, char *sql_buffer, db_data *dat,
-                   int *to_chng, char *dv_str, pthread_mutex_t *lck,
-                   sem_t *mtx );
+int initialize_db( config *cfg, sqlite3 *db, char *sql_buffer, db_table *tbl,
+                   pthread_rwlock_t *lck );
+void close_db();
+void free_db_table( db_table *tbl );
+
+int get_device_slot( const char *dev_name );
+int index_device_name( const int slot );
+void unindex_device_name( const char *dev_name );
+int get_free_slot();
+void put_free_slot( const int slot );
+void queue_db_change( const int slot );
 
 const int get_current_entry_count();
 void decrement_db_count();
 void increment_db_count();
 int check_device_type( const int in );
-char *device_type_to_str( const int in );
+const char *device_type_to_str( const int in );
 int get_digit_count( const int in );
 void powerstrip_cmnd_cat( char *dst, const int count );
+db_detail *new_db_detail( const char *valid_cmnds );
 
 void *db_updater( void* args );
 
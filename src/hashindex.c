@@ -0,0 +1,274 @@
+/*
+ * A small case-insensitive hash index, mapping strings
+ * (device names, topics) to their slot in memory.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (C) 2019-2021, Christian Kissinger
+ * kiss-light Hub is released under the New BSD license (see LICENSE).
+ * Go to the project repo here:
+ * https://gitlab.com/kiss-light-project/Kiss-Light_Hub
+ *
+ * Written by: Christian Kissinger
+ */
+
+// system-related includes
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+// local includes
+#include "hashindex.h"
+
+/**
+ * @brief case-insensitive FNV-1a hash of a string.
+ *
+ * @param key the string to be hashed, need not be terminated.
+ * @param len the length of key.
+ *
+ * @note Returns the hash.
+ */
+uint32_t hash_index_hash( const char *key, const int len )
+{
+    uint32_t h = 2166136261U;
+
+    for ( int i = 0; i < len; i++ )
+    {
+        h ^= (uint32_t)tolower( (unsigned char)key[i] );
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/**
+ * @brief Find the bucket for a key, or the empty bucket it would go in.
+ *
+ * @param entries the bucket array.
+ * @param capacity the amount of buckets, a power of 2.
+ * @param key the key of interest.
+ * @param len the length of key.
+ * @param h the hash of key.
+ *
+ * @note Returns the bucket position.
+ */
+static int probe( const hash_entry *entries, const int capacity,
+                  const char *key, const int len, const uint32_t h )
+{
+    int mask = capacity - 1;
+    int pos = h & mask;
+    int tomb = -1;
+
+    while ( entries[pos].slot != -1 )
+    {
+        if ( entries[pos].slot == HASH_INDEX_TOMB )
+        {
+            /* remember the first tombstone, for reuse */
+            if ( tomb < 0 )
+            {
+                tomb = pos;
+            }
+        }
+        else if ( entries[pos].hash == h && entries[pos].key_len == len &&
+                  strncasecmp(entries[pos].key, key, len) == 0 )
+        {
+            return pos;
+        }
+
+        pos = (pos + 1) & mask;
+    }
+
+    return ( tomb >= 0 ) ? tomb : pos;
+}
+
+/**
+ * @brief Move every entry to a new bucket array, dropping tombstones.
+ *
+ * @param hi the index to be resized.
+ * @param capacity the new amount of buckets, a power of 2.
+ *
+ * @note Returns nonzero upon error.
+ */
+static int resize( hash_index *hi, const int capacity )
+{
+    hash_entry *entries = (hash_entry *)malloc(
+        capacity * sizeof(hash_entry)
+    );
+
+    if ( entries == NULL )
+    {
+        return 1;
+    }
+
+    for ( int i = 0; i < capacity; i++ )
+    {
+        entries[i].slot = -1;
+    }
+
+    for ( int i = 0; i < hi->capacity; i++ )
+    {
+        if ( hi->entries[i].slot < 0 )
+        {
+            continue;
+        }
+
+        int pos = probe( entries, capacity, hi->entries[i].key,
+                         hi->entries[i].key_len, hi->entries[i].hash );
+        entries[pos] = hi->entries[i];
+    }
+
+    free( hi->entries );
+    hi->entries = entries;
+    hi->capacity = capacity;
+    hi->tombs = 0;
+
+    return 0;
+}
+
+/**
+ * @brief Initialize an empty index.
+ *
+ * @param hi the index to be initialized.
+ * @param count the amount of keys expected, it grows past this if needed.
+ *
+ * @note Returns nonzero upon error.
+ */
+int hash_index_init( hash_index *hi, const int count )
+{
+    int capacity = HASH_INDEX_MIN;
+
+    /* keep the load factor at or below one half */
+    while ( capacity < (count * 2) )
+    {
+        capacity <<= 1;
+    }
+
+    hi->entries = NULL;
+    hi->capacity = 0;
+    hi->count = 0;
+    hi->tombs = 0;
+
+    return resize( hi, capacity );
+}
+
+/**
+ * @brief Free everything the index holds.
+ *
+ * @param hi the index to be free'd.
+ */
+void hash_index_free( hash_index *hi )
+{
+    for ( int i = 0; i < hi->capacity; i++ )
+    {
+        if ( hi->entries[i].slot >= 0 )
+        {
+            free( hi->entries[i].key );
+        }
+    }
+
+    free( hi->entries );
+    hi->entries = NULL;
+    hi->capacity = 0;
+    hi->count = 0;
+    hi->tombs = 0;
+}
+
+/**
+ * @brief Add a key to the index, the key is copied.
+ *
+ * @param hi the index of interest.
+ * @param key the key, matched case-insensitively.
+ * @param slot the slot the key refers to.
+ *
+ * @note Returns 2 if the key already exists, 1 upon any other error,
+ * returns 0 otherwise.
+ */
+int hash_index_insert( hash_index *hi, const char *key, const int slot )
+{
+    /* grow (or clean out tombstones) before it gets too full */
+    if ( (hi->count + hi->tombs + 1) * 4 > hi->capacity * 3 )
+    {
+        int capacity = ( (hi->count + 1) * 2 > hi->capacity ) ?
+                       hi->capacity << 1 : hi->capacity;
+
+        if ( resize( hi, capacity ) )
+        {
+            return 1;
+        }
+    }
+
+    int len = strlen( key );
+    uint32_t h = hash_index_hash( key, len );
+    int pos = probe( hi->entries, hi->capacity, key, len, h );
+
+    if ( hi->entries[pos].slot >= 0 )
+    {
+        return 2;
+    }
+
+    char *copy = strndup( key, len );
+
+    if ( copy == NULL )
+    {
+        return 1;
+    }
+
+    if ( hi->entries[pos].slot == HASH_INDEX_TOMB )
+    {
+        hi->tombs--;
+    }
+
+    hi->entries[pos].key = copy;
+    hi->entries[pos].key_len = len;
+    hi->entries[pos].hash = h;
+    hi->entries[pos].slot = slot;
+    hi->count++;
+
+    return 0;
+}
+
+/**
+ * @brief Look a key up.
+ *
+ * @param hi the index of interest.
+ * @param key the key, need not be terminated.
+ * @param len the length of key.
+ *
+ * @note Returns the slot, or -1 if there is no such key.
+ */
+int hash_index_find( const hash_index *hi, const char *key, const int len )
+{
+    int pos = probe( hi->entries, hi->capacity, key, len,
+                     hash_index_hash(key, len) );
+
+    return ( hi->entries[pos].slot >= 0 ) ? hi->entries[pos].slot : -1;
+}
+
+/**
+ * @brief Remove a key from the index.
+ *
+ * @param hi the index of interest.
+ * @param key the key to be removed.
+ *
+ * @note Returns the slot the key referred to, or -1 if there is no such key.
+ */
+int hash_index_remove( hash_index *hi, const char *key )
+{
+    int len = strlen( key );
+    int pos = probe( hi->entries, hi->capacity, key, len,
+                     hash_index_hash(key, len) );
+    int slot = hi->entries[pos].slot;
+
+    if ( slot < 0 )
+    {
+        return -1;
+    }
+
+    free( hi->entries[pos].key );
+    hi->entries[pos].key = NULL;
+    hi->entries[pos].slot = HASH_INDEX_TOMB;
+    hi->count--;
+    hi->tombs++;
+
+    return slot;
+}
@@ -0,0 +1,59 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (C) 2019-2021, Christian Kissinger
+ * kiss-light Hub is released under the New BSD license (see LICENSE).
+ * Go to the project repo here:
+ * https://gitlab.com/kiss-light-project/Kiss-Light_Hub
+ *
+ * Written by: Christian Kissinger
+ */
+
+#ifndef HASHINDEX_H_
+#define HASHINDEX_H_
+
+/* Includes in case the compiler complains */
+#include <stdint.h>
+
+/* Constants */
+enum {
+    /* must be a power of 2 */
+    HASH_INDEX_MIN = 16,
+
+    /* marks a bucket whose entry was removed */
+    HASH_INDEX_TOMB = -2
+};
+
+/**
+ * @typedef hash_entry
+ * @brief a single bucket, slot is -1 when empty.
+ */
+typedef struct
+{
+    char *key;
+    int key_len;
+    uint32_t hash;
+    int slot;
+} hash_entry;
+
+/**
+ * @typedef hash_index
+ * @brief case-insensitive string to device slot index,
+ * open addressing with linear probing.
+ */
+typedef struct
+{
+    hash_entry *entries;
+    int capacity;
+    int count;
+    int tombs;
+} hash_index;
+
+/* prototypes */
+uint32_t hash_index_hash( const char *key, const int len );
+int hash_index_init( hash_index *hi, const int count );
+void hash_index_free( hash_index *hi );
+int hash_index_insert( hash_index *hi, const char *key, const int slot );
+int hash_index_find( const hash_index *hi, const char *key, const int len );
+int hash_index_remove( hash_index *hi, const char *key );
+
+#endif
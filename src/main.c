@@ -21,7 +21,6 @@
 #include <stdint.h>
 #include <signal.h>
 #include <pthread.h>
-#include <poll.h>
 
 // local includes
 #include "main.h"
@@ -42,15 +41,9 @@
  */
 typedef struct
 {
-    // Server buffers
-    char **server_buffer;
-    struct pollfd *clientfds;
-
     // SQL buffers
     char *sql_buffer;
     char *sqlite_buffer;
-    char *dev_type_str;
-    int *changes;
 
     // Mqtt buffers
     uint8_t *send_buffer;
@@ -65,54 +58,22 @@ typedef struct
  *
  * @param bfrs the buffers to be malloc'd.
  * @param cfg to allocate buffers per what config contains.
- * @param memory the struct array for database entries.
  *
  * @note The buffers are memsetted
  * so valgrind will not complain.
  *
  */
-static void allocate_buffers( buffers *bfrs, config *cfg, db_data *memory )
+static void allocate_buffers( buffers *bfrs, config *cfg )
 {
 #ifdef DEBUG
     log_trace( "allocating buffers" );
-    log_debug( "allocating server buffers" );
 #endif
 
-    bfrs->server_buffer = malloc( (POLL_SIZE - 1) * sizeof(char *) );
-    bfrs->changes = (int *)malloc( cfg->max_dev_count * sizeof(int) );
-    bfrs->clientfds = (struct pollfd *)malloc(
-        POLL_SIZE * sizeof(struct pollfd)
-    );
-
-    // One big loop to avoid the need for several
-    int len = ( cfg->max_dev_count > (POLL_SIZE - 1) ) ?
-                cfg->max_dev_count : (POLL_SIZE - 1);
-    for ( int i = 0; i < len; i++ )
-    {
-        if ( i < (POLL_SIZE - 1) )
-        {
-            bfrs->server_buffer[i] = (char *)malloc(
-                cfg->buffer_size * sizeof(char)
-            );
-            memset( bfrs->server_buffer[i], 0, cfg->buffer_size );
-        }
-
-        /* initialize the changes buffer too */
-        if ( i < cfg->max_dev_count )
-        {
-            bfrs->changes[i] = -1;
-
-            memset( memory[i].dev_name, 0, DB_DATA_LEN );
-            memset( memory[i].mqtt_topic, 0, DB_DATA_LEN );
-            memory[i].dev_type = -1;
-            memset( memory[i].dev_state, 0, DV_STATE_LEN );
-            memset( memory[i].valid_cmnds, 0, DB_CMND_LEN );
-
-
-            memset( memory[i].odev_name, 0, DB_DATA_LEN );
-            memset( memory[i].omqtt_topic, 0, DB_DATA_LEN );
-        }
-    }
+    /*
+     * Client buffers are no longer allocated here,
+     * the server allocates them per connection. Nor is
+     * the device table, it grows as devices are added.
+     */
 
 #ifdef DEBUG
     log_debug( "allocating sql buffer" );
@@ -124,8 +85,6 @@ static void allocate_buffers( buffers *bfrs, config *cfg, db_data *memory )
         SQLITE_BUFFER_LEN * sizeof(char)
     );
     memset( bfrs->sqlite_buffer, 0, SQLITE_BUFFER_LEN );
-    bfrs->dev_type_str = (char *)malloc( DEV_TYPE_LEN * sizeof(char) );
-    memset( bfrs->dev_type_str, 0, DEV_TYPE_LEN );
 
 #ifdef DEBUG
     log_debug( "allocating mqtt buffers" );
@@ -155,12 +114,12 @@ static void allocate_buffers( buffers *bfrs, config *cfg, db_data *memory )
  * @param lg the logfile to be closed.
  * @param bfrs the buffers to be free'd.
  * @param cfg the config struct to be free'd.
- * @param memory the database struct array to be free'd.
+ * @param memory the device table to be free'd.
  * @param client the mqtt_client to be free'd, can be NULL if not
  * yet allocated.
  *
  */
-static void cleanup( FILE *lg, buffers *bfrs, config *cfg, db_data *memory,
+static void cleanup( FILE *lg, buffers *bfrs, config *cfg, db_table *memory,
                      struct mqtt_client *client )
 {
 #ifdef DEBUG
@@ -168,6 +127,11 @@ static void cleanup( FILE *lg, buffers *bfrs, config *cfg, db_data *memory,
     log_debug( "Freeing config data allocated" );
 #endif
 
+    /* these are sized by the config, so free them before it */
+    free_topic_routes();
+    free_response_cache();
+    free_workers();
+
     /* Clean up allocated strings */
     if ( cfg->db_loc != NULL )
     {
@@ -181,6 +145,12 @@ static void cleanup( FILE *lg, buffers *bfrs, config *cfg, db_data *memory,
         cfg->mqtt_server = NULL;
     }
 
+    if ( cfg->unix_socket != NULL )
+    {
+        free( (void*)cfg->unix_socket );
+        cfg->unix_socket = NULL;
+    }
+
     /* Finally free allocated memory used by config */
     free( cfg );
     cfg = NULL;
@@ -191,34 +161,16 @@ static void cleanup( FILE *lg, buffers *bfrs, config *cfg, db_data *memory,
 #endif
 
     /* Now to free the memory allocated by buffers */
-    int len = (POLL_SIZE - 1);
-    for ( int i = 0; i < len; i++ )
-    {
-        free( bfrs->server_buffer[i] );
-        bfrs->server_buffer[i] = NULL;
-    }
-
+    free_db_table( memory );
     free( memory );
     memory = NULL;
 
-    free( bfrs->server_buffer );
-    bfrs->server_buffer = NULL;
-
-    free( bfrs->clientfds );
-    bfrs->clientfds = NULL;
-
     free( bfrs->sql_buffer );
     bfrs->sql_buffer = NULL;
 
     free( bfrs->sqlite_buffer );
     bfrs->sqlite_buffer = NULL;
 
-    free( bfrs->dev_type_str );
-    bfrs->dev_type_str = NULL;
-
-    free( bfrs->changes );
-    bfrs->changes = NULL;
-
     free( bfrs->send_buffer );
     bfrs->send_buffer = NULL;
 
@@ -244,6 +196,7 @@ static void cleanup( FILE *lg, buffers *bfrs, config *cfg, db_data *memory,
 #ifdef DEBUG
         log_debug( "Freeing mqtt_client struct" );
 #endif
+        close_mqtt();
         free( client );
         client = NULL;
 
@@ -335,6 +288,12 @@ int main( int argc, char **argv )
             cfg->mqtt_server = NULL;
         }
 
+        if ( cfg->unix_socket != NULL )
+        {
+            free( (void*)cfg->unix_socket );
+            cfg->unix_socket = NULL;
+        }
+
         free( cfg );
 
 #ifdef DEBUG
@@ -355,26 +314,22 @@ int main( int argc, char **argv )
      * Step 4: Allocate Buffers for server, mqtt functions, sqlite functions
      */
     buffers *bfrs = (buffers *)malloc( sizeof(buffers) );
-    db_data *memory = (db_data *)malloc( cfg->max_dev_count * sizeof(db_data) );
-    allocate_buffers( bfrs, cfg, memory );
+    db_table *memory = (db_table *)calloc( 1, sizeof(db_table) );
+    allocate_buffers( bfrs, cfg );
 
     /*
-     * Step 5: Initialize mutex semaphores, share info to server part of code
+     * Step 5: Initialize the device table lock, share info to server part of code
      */
 #ifdef DEBUG
-    log_trace( "Initializing semaphores and copying data to server code" );
+    log_trace( "Initializing lock and copying data to server code" );
 #endif
 
-    pthread_mutex_t lock;
-    sem_t mutex;
-    pthread_mutex_init( &lock, NULL );
-    sem_init( &mutex, 0, 1 );
-    assign_buffers( bfrs->server_buffer, bfrs->topic,
-                    bfrs->application_message, memory,
-                    cfg, bfrs->changes, &lock, &mutex,
-                    bfrs->clientfds );
+    pthread_rwlock_t lock;
+    pthread_rwlock_init( &lock, NULL );
+    assign_buffers( bfrs->topic, bfrs->application_message, memory,
+                    cfg, &lock );
 #ifdef DEBUG
-    log_trace( "semaphores initialized" );
+    log_trace( "lock initialized" );
 #endif
 
     /*
@@ -421,12 +376,11 @@ int main( int argc, char **argv )
 #endif
     }
 
-    status = initialize_db( cfg, db, bfrs->sql_buffer, memory, bfrs->changes,
-                            bfrs->dev_type_str, &lock, &mutex );
+    status = initialize_db( cfg, db, bfrs->sql_buffer, memory, &lock );
 
     if ( status )
     {
-        sqlite3_close( db );
+        close_db();
 
 #ifdef DEBUG
         log_error( "Some SQL error occurred, exiting..." );
@@ -437,6 +391,26 @@ int main( int argc, char **argv )
         return 1;
     }
 
+    /*
+     * route incoming device states to their place in memory,
+     * make room for the responses rendered from it, and set up
+     * the server's workers
+     */
+    if ( initialize_topic_routes() || initialize_response_cache()
+      || initialize_workers() )
+    {
+        close_db();
+
+#ifdef DEBUG
+        log_error( "Unable to build topic routes, response cache or "
+                   "server workers, exiting..." );
+        cleanup( lg, bfrs, cfg, memory, NULL );
+#else
+        cleanup( NULL, bfrs, cfg, memory, NULL );
+#endif
+        return 1;
+    }
+
     /*
      * Step 7: Initialize mqtt listener
      */
@@ -446,7 +420,7 @@ int main( int argc, char **argv )
 
     if ( sockfd_mqtt < 0 )
     {
-        sqlite3_close( db );
+        close_db();
 
 #ifdef DEBUG
         perror("Failed to open socket: ");
@@ -477,7 +451,7 @@ int main( int argc, char **argv )
 
     if ( mqtt_stat )
     {
-        sqlite3_close( db );
+        close_db();
 
 #ifdef DEBUG
         log_error( "Failed to initialize MQTT server, exiting..." );
@@ -489,30 +463,37 @@ int main( int argc, char **argv )
         return 1;
     }
 
-    /* A loop to subscribe all the stat topics */
-    int count = 0;
-    for ( int i = 0; i < cfg->max_dev_count; i++ )
+    /* subscribe to the stat topics of every device */
+    subscribe_devices();
+
+    /*
+     * Step 8: Create state applier, mqtt client and database updater threads
+     */
+
+    /* Establish pthread for the state applier, before states arrive */
+    pthread_t applier_thr;
+    if ( pthread_create(&applier_thr, NULL, state_applier, NULL) )
     {
-        /* If all entries are in, break out of loop */
-        if ( count == get_current_entry_count() )
+#ifdef DEBUG
+        log_error( "Failed to start state applier, exiting..." );
+#endif
+
+        if (sockfd_mqtt != -1 )
         {
-            break;
+            close( sockfd_mqtt );
         }
 
-        prepare_topic( STAT, memory[i].mqtt_topic, (char *)RESULT );
-        mqtt_subscribe( client, bfrs->topic, 0 );
+        /* Cleanup and exit, this is a big deal. */
+        close_db();
 
 #ifdef DEBUG
-        log_info( "subscribed to %s", bfrs->topic );
+        cleanup( lg, bfrs, cfg, memory, client );
+#else
+        cleanup( NULL, bfrs, cfg, memory, client );
 #endif
-
-        count++;
+        return 1;
     }
 
-    /*
-     * Step 8: Create mqtt client and database updater threads
-     */
-
     /* Establish pthread for daemon */
     pthread_t mqtt_client_thr;
     if( pthread_create(&mqtt_client_thr, NULL, client_refresher, client) )
@@ -521,13 +502,16 @@ int main( int argc, char **argv )
         log_error( "Failed to start mqtt client daemon, exiting..." );
 #endif
 
+        pthread_cancel(applier_thr);
+        pthread_join(applier_thr, NULL);
+
         if (sockfd_mqtt != -1 )
         {
             close( sockfd_mqtt );
         }
 
         /* Cleanup and exit, this is a big deal. */
-        sqlite3_close( db );
+        close_db();
 
 #ifdef DEBUG
         cleanup( lg, bfrs, cfg, memory, client );
@@ -546,9 +530,11 @@ int main( int argc, char **argv )
         log_error( "Failed to start db updater, exiting..." );
 #endif
 
-        /* Kill this thread as it will no longer be required */
+        /* Kill these threads as they will no longer be required */
         pthread_cancel(mqtt_client_thr);
         pthread_join(mqtt_client_thr, NULL);
+        pthread_cancel(applier_thr);
+        pthread_join(applier_thr, NULL);
 
         if (sockfd_mqtt != -1 )
         {
@@ -556,7 +542,7 @@ int main( int argc, char **argv )
         }
 
         /* Cleanup and exit, this is a big deal. */
-        sqlite3_close( db );
+        close_db();
 
 #ifdef DEBUG
         cleanup( lg, bfrs, cfg, memory, client );
@@ -571,6 +557,21 @@ int main( int argc, char **argv )
      */
     int sockfd = create_server_socket( cfg->port );
 
+    /* the local listener is optional, -1 unless unix_socket is set */
+    int unixfd = -1;
+
+    if ( sockfd >= 0 && cfg->unix_socket != NULL
+      && cfg->unix_socket[0] != '\0' )
+    {
+        unixfd = create_unix_socket( cfg->unix_socket );
+
+        if ( unixfd < 0 )
+        {
+            close( sockfd );
+            sockfd = -1;
+        }
+    }
+
     /*
      * If sockfd initialization is successful,
      * run the server.
@@ -583,18 +584,27 @@ int main( int argc, char **argv )
         /*
          * Time to Poll and run the server's network loop.
          */
-        if ( listen( sockfd, LISTEN_QUEUE ) < 0 )
+        if ( listen( sockfd, LISTEN_QUEUE ) < 0
+          || (unixfd >= 0 && listen( unixfd, LISTEN_QUEUE ) < 0) )
         {
 #ifdef DEBUG
             log_error( "Error listening" );
 #endif
 
+            if ( unixfd >= 0 )
+            {
+                close( unixfd );
+                unlink( cfg->unix_socket );
+            }
+
             pthread_cancel(mqtt_client_thr);
             pthread_cancel(database_thr);
             pthread_join(mqtt_client_thr, NULL);
             pthread_join(database_thr, NULL);
+            pthread_cancel(applier_thr);
+            pthread_join(applier_thr, NULL);
 
-            sqlite3_close( db );
+            close_db();
 
 #ifdef DEBUG
             cleanup( lg, bfrs, cfg, memory, client );
@@ -609,7 +619,7 @@ int main( int argc, char **argv )
         log_trace( "Going into loop" );
 #endif
 
-        server_loop( sockfd );
+        server_loop( sockfd, unixfd );
 
 #ifdef DEBUG
         log_trace( "server exiting" );
@@ -619,8 +629,16 @@ int main( int argc, char **argv )
         pthread_cancel(database_thr);
         pthread_join(mqtt_client_thr, NULL);
         pthread_join(database_thr, NULL);
+        pthread_cancel(applier_thr);
+        pthread_join(applier_thr, NULL);
 
         close( sockfd );
+
+        if ( unixfd >= 0 )
+        {
+            close( unixfd );
+            unlink( cfg->unix_socket );
+        }
     }
     else
     {
@@ -633,9 +651,11 @@ int main( int argc, char **argv )
         pthread_cancel(database_thr);
         pthread_join(mqtt_client_thr, NULL);
         pthread_join(database_thr, NULL);
+        pthread_cancel(applier_thr);
+        pthread_join(applier_thr, NULL);
 
         /* Cleanup and exit, this is a big deal. */
-        sqlite3_close( db );
+        close_db();
 
 #ifdef DEBUG
         cleanup( lg, bfrs, cfg, memory, client );
@@ -650,7 +670,7 @@ int main( int argc, char **argv )
      * From this point, it can be safely assumed that
      * if this point is reached, it is time to wrap up.
      */
-    sqlite3_close( db );
+    close_db();
 
 #ifdef DEBUG
     cleanup( lg, bfrs, cfg, memory, client );
@@ -16,18 +16,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
-#include <semaphore.h>
 
 // socket-related includes
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <poll.h>
 #include <sys/wait.h>
 #include <fcntl.h>
@@ -39,6 +46,8 @@
 #include "daemon.h"
 #include "mqttc/mqtt.h"
 #include "statejson.h"
+#include "hashindex.h"
+#include "statering.h"
 
 #ifdef DEBUG
 #include "log/log.h"
@@ -48,12 +57,15 @@
 static config *conf;
 
 // pointers for database functions.
-static db_data *memory;
-static int *to_change;
+static db_table *memory;
 
-// pointers for various server buffers and fds
-static char **server_buffer;
-static struct pollfd *clientfds;
+// server threads, each with its own epoll instance and connections
+static kl_worker *workers = NULL;
+static int worker_count = 0;
+
+// connections across every worker, checked against max_clients
+static int client_count = 0;
+static pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // mqtt buffers
 static char *topic;
@@ -62,26 +74,73 @@ static char *app_msg;
 // mqtt client pointer
 struct mqtt_client *cl;
 
-// System pointers
-static pthread_mutex_t *lock;
-static sem_t *mutex;
+/*
+ * signalled whenever something is queued on the mqtt client,
+ * so the refresher thread sends it without waiting.
+ */
+static int mqtt_wakefd = -1;
+
+/*
+ * set alongside mqtt_wakefd, taken by the refresher before each sync so
+ * it knows to watch for the socket taking the rest of a blocked send.
+ * Kept here as mqtt-c's queue is its own, and only safe under its lock.
+ */
+static int mqtt_queued = 0;
+
+/*
+ * states received by the mqtt thread, applied by state_applier(). The
+ * callback runs with the mqtt client locked, and requests hold the device
+ * table lock while publishing, so the callback must not take that lock.
+ * Nor does the mqtt thread wait on it, it goes on receiving meanwhile.
+ * states_pushed is only used by the mqtt thread, set until it wakes the
+ * applier through applier_wakefd.
+ */
+static state_ring states;
+static int states_pushed = 0;
+static int applier_wakefd = -1;
+
+// short mqtt topic (the <topic> in stat/<topic>/RESULT) to device slot
+static hash_index topic_index;
+
+/*
+ * guards memory and the indexes, requests that only
+ * read devices share it, anything that changes them holds it alone.
+ */
+static pthread_rwlock_t *lock;
+
+/*
+ * rendered STATUS responses per slot, and the full LIST response.
+ * Readers share the device table lock, so filling these takes cache_lock.
+ */
+static kl_cache *status_cache;
+static kl_cache list_cache;
+static unsigned int list_version = 1;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* slots status_cache and the workers' notify queues have room for */
+static int slot_capacity;
 
 /*
  * When exiting, close server's socket,
  * using this variable
  */
-static unsigned int closeSocket = 0;
+static volatile sig_atomic_t closeSocket = 0;
 
 /* local prototypes as needed */
 static int add_device( const char *dv_name, const char *mqtt_tpc,
                        const int dv_type, const char *vld_cmds );
 static int delete_device( char *dv_name );
-static int update_device( const char *req, const char *dev_name,
+static int update_device( const int req, const char *dev_name,
                           const char *arg, char *buf, int *n );
 static int change_dev_state( const char *dv_name, const char *cmd, char *msg );
 static int toggle_dev_power( const char *dv_name, const char *msg );
-static void dump_devices( char *buf, int *n );
+static int dump_devices( kl_conn *c, const int offset, const int limit,
+                         const int dv_type, char *buf );
+static int queue_response( kl_conn *c, const char *data, int len );
 static int get_dev_state( const char *dv_name, char *buf, int *n );
+static void wake_mqtt();
+static int flush_responses( kl_conn *c );
+static void close_connection( kl_conn *c );
 
 /*******************************************************************************
  * Non-specific server-related initializations will reside here.
@@ -91,33 +150,24 @@ static int get_dev_state( const char *dv_name, char *buf, int *n );
  ******************************************************************************/
 
 /**
- * @brief assign buffers and mutex semaphores to the server.
+ * @brief assign buffers and the device table lock to the server.
  *
- * @param srvr_buf The server's buffer.
- * @param str_buf The parser's buffer.
  * @param tpc the topic buffer.
  * @param application_msg the application message buffer.
- * @param data the struct array of database entries.
+ * @param data the device table.
  * @param cfg the configuration struct
- * @param to_chng the int array to indicate what is to be updated
- * @param lck the pthread mutex lock
- * @param mtx the semaphore mutex lock
+ * @param lck the device table's reader-writer lock
  *
+ * @note client buffers are allocated per connection by the server loop.
  */
-void assign_buffers( char **srvr_buf, char *tpc, char *application_msg,
-                     db_data *data, config *cfg, int *to_chng,
-                     pthread_mutex_t *lck, sem_t *mtx,
-                     struct pollfd *cfds )
+void assign_buffers( char *tpc, char *application_msg,
+                     db_table *data, config *cfg, pthread_rwlock_t *lck )
 {
-    server_buffer = srvr_buf;
     topic = tpc;
     app_msg = application_msg;
     memory = data;
-    to_change = to_chng;
     conf = cfg;
     lock = lck;
-    mutex = mtx;
-    clientfds = cfds;
 }
 
 /**
@@ -140,8 +190,9 @@ static void convert_to_upper( char *str )
 }
 
 /**
- * @brief Prepare full mqtt topic for the topic buffer.
+ * @brief Prepare full mqtt topic for a topic buffer.
  *
+ * @param dst the topic buffer, conf->topic_buff long.
  * @param prefix the prefix of the full mqtt topic, should be 'stat/' for
  * subscriptions, or 'cmnd/' for sending commands, but could be used for
  * anything else if desired.
@@ -149,10 +200,10 @@ static void convert_to_upper( char *str )
  * @param suffix the suffix of the full mqtt topic, should be a commmand,
  * or if subscribing, use '/RESULT'.
  *
- * @note the topic buffer gets memsetted, so use carefully. It is also
- * not thread safe, so make sure to implement semaphores when using.
+ * @note dst gets memsetted, so use carefully. Readers holding the
+ * lock shared must pass their own buffer rather than the topic buffer.
  */
-void prepare_topic( const char *prefix, const char *tpc,
+void prepare_topic( char *dst, const char *prefix, const char *tpc,
                     char *suffix )
 {
     /*
@@ -170,7 +221,7 @@ void prepare_topic( const char *prefix, const char *tpc,
     }
 
     /* memset the buffer just in case */
-    memset( topic, 0, conf->topic_buff );
+    memset( dst, 0, conf->topic_buff );
 
     /* create full topic */
     int pfx = strlen( prefix );
@@ -189,1504 +240,3410 @@ void prepare_topic( const char *prefix, const char *tpc,
         int len = ((pfx + topc + sfx + 2) < conf->topic_buff ) ?
                     pfx + topc + sfx + 2 : conf->topic_buff;
 
-        snprintf( topic, len, "%s%s/%s", prefix, tpc, suffix );
+        snprintf( dst, len, "%s%s/%s", prefix, tpc, suffix );
     }
     else
     {
         int len = ((pfx + topc + sfx + 1) < conf->topic_buff ) ?
                     pfx + topc + sfx + 1 : conf->topic_buff;
 
-        snprintf( topic, len, "%s%s%s", prefix, tpc, suffix );
+        snprintf( dst, len, "%s%s%s", prefix, tpc, suffix );
     }
 }
 
 /**
- * @brief Verify that the command is valid given a list
- * of valid commands associated with a device.
+ * @brief Route a device's stat/<topic>/RESULT publishes to its slot.
  *
- * @param input the input command to compare against the cmnds.
- * @param cmnds the list of commands to be compared with, delimited by
- * a comma.
+ * @param tpc the short mqtt topic of the device.
+ * @param slot the slot of the device.
  *
- * @note Returns nonzero upon error.
+ * @note Returns nonzero upon error, a topic already routed to another
+ * device sharing it is not one. Only call when in the critical space
+ * of a semaphore.
  */
-static int verify_command( const char *input, const char *cmnds )
+static int add_topic_route( const char *tpc, const int slot )
 {
-    int rv = 0;
+    if ( hash_index_insert( &topic_index, tpc, slot ) == 1 )
+    {
+#ifdef DEBUG
+        log_error( "Unable to route topic %s", tpc );
+#endif
 
-    /* create temporary copy to keep original in tact. */
-    char tmp_cmnds[DB_CMND_LEN];
-    strncpy( tmp_cmnds, cmnds, strlen(cmnds) + 1 );
+        return 1;
+    }
 
-    char *tok;
-    tok = strtok(tmp_cmnds, ",");
+    return 0;
+}
+
+/**
+ * @brief Stop routing a short mqtt topic to a device moving off it.
+ *
+ * @param tpc the short mqtt topic that is no longer used by the device.
+ * @param slot the slot of the device moving off the topic.
+ *
+ * @note If another device shares the topic, it takes over the route,
+ * whether or not the route pointed at slot. Only call when in the
+ * critical space of a semaphore.
+ */
+static void remove_topic_route( const char *tpc, const int slot )
+{
+    if ( hash_index_remove( &topic_index, tpc ) < 0 )
+    {
+        return;
+    }
 
-    while ( tok != 0 )
+    for ( int i = 0; i < memory->capacity; i++ )
     {
-        if ( strncasecmp(input, tok, strlen(input) + 1) == 0 )
+        const db_data *dev = DB_DEVICE(memory, i);
+
+        if ( i != slot && dev->dev_name[0] != '\0'
+          && strcasecmp(dev->mqtt_topic, tpc) == 0 )
         {
-            rv = 0;
+            add_topic_route( dev->mqtt_topic, i );
             break;
         }
+    }
+}
+
+/**
+ * @brief Build the topic routes for every device in memory.
+ *
+ * @note Call once the database is loaded into memory.
+ * Returns nonzero upon error.
+ */
+int initialize_topic_routes()
+{
+    if ( hash_index_init( &topic_index, memory->capacity ) )
+    {
+        return 1;
+    }
 
-        tok = strtok( 0, "," );
+    for ( int i = 0; i < memory->capacity; i++ )
+    {
+        const db_data *dev = DB_DEVICE(memory, i);
 
-        /* if we made it this far, it is likely not a valid command */
-        if ( tok == 0 )
+        if ( dev->dev_name[0] != '\0'
+          && add_topic_route( dev->mqtt_topic, i ) )
         {
-            rv = 1;
+            return 1;
         }
     }
 
-    return rv;
+    return 0;
 }
 
-/*******************************************************************************
- * Everything related to message parsing will reside here.
- ******************************************************************************/
-
 /**
- * @brief Check protocol version.
+ * @brief Find the device a stat/<topic>/RESULT (or /STATE) publish is from.
  *
- * @param buf the buffer that contains the protocol version.
+ * @param tpc the full topic, need not be terminated.
+ * @param len the length of tpc.
  *
- * @note example being: KL/0.3 .
- * Return protocol_version if valid
- * or -1.0 if invalid.
+ * @note Returns -1 if no device uses the topic, the slot otherwise.
+ * Only call when in the critical space of a semaphore.
  */
-static float get_protocol_version(char *buf)
+static int find_topic_route( const char *tpc, const int len )
 {
-    float protocol = -1.0;
+    int pfx = STAT_LEN - 1;
+    int sfx = 0;
 
-    /*
-     * check to make sure buf isn't empty and first part equals KL or
-     * something along those lines
-     */
-    if ( strncasecmp( buf, "KL", 2) != 0 )
+    if ( len <= pfx || strncasecmp(tpc, STAT, pfx) != 0 )
     {
-        return protocol;
+        return -1;
     }
 
-    /* Now extract the protocol version itself */
-    if ( strncmp( buf, "kl", 2) == 0 )
-    {
-        sscanf( buf, "kl/%f", &protocol );
-    }
-    else if ( strncmp( buf, "Kl", 2) == 0 )
+    /* routing is by the <topic> segment, so strip the suffix */
+    if ( len > (pfx + RESULT_LEN - 1) &&
+         strncasecmp(tpc + len - (RESULT_LEN - 1), RESULT,
+                     RESULT_LEN - 1) == 0 )
     {
-        sscanf( buf, "Kl/%f", &protocol );
+        sfx = RESULT_LEN - 1;
     }
-    else if ( strncmp( buf, "kL", 2 ) == 0 )
+    else if ( len > (pfx + STATE_LEN - 1) &&
+              strncasecmp(tpc + len - (STATE_LEN - 1), STATE,
+                          STATE_LEN - 1) == 0 )
     {
-        sscanf( buf, "kL/%f", &protocol );
+        sfx = STATE_LEN - 1;
     }
     else
     {
-        sscanf( buf, "KL/%f", &protocol );
-    }
-
-    /* make sure the protocol version is correct */
-    if ( protocol <= 0.0 )
-    {
-        return -1.0;
+        return -1;
     }
 
-    return protocol;
+    return hash_index_find( &topic_index, tpc + pfx, len - pfx - sfx );
 }
 
 /**
- * @brief Parse whatever the client sent in,
- * Do the task if applicable,
- * And send over the proper response.
+ * @brief Free the topic routes.
  *
- * @param buf the buffer to be analyzed, THEN MODIFIED.
- * @param n the buffer length, modified when buf is modified.
+ * @note Safe to call even if initialize_topic_routes() was not.
+ */
+void free_topic_routes()
+{
+    hash_index_free( &topic_index );
+}
+
+/**
+ * @brief Allocate the cached STATUS responses, one per device slot.
  *
- * @note Returns -1 when a user requests to quit, Returns 0 otherwise.
+ * @note Returns nonzero upon error.
  */
-static int parse_server_request( char *buf, int *n )
+int initialize_response_cache()
 {
-    /* return value, should be zero unless user wants to quit */
-    int rv = 0;
+    status_cache = (kl_cache *)calloc( memory->capacity, sizeof(kl_cache) );
 
-    /* Create tmporary buffer */
-    char tmp[conf->buffer_size];
-    strncpy( tmp, buf, strlen(buf) + 1 );
+    if ( status_cache == NULL )
+    {
+        return 1;
+    }
 
-    /* clean buffer for reuse */
-    memset( buf, 0, conf->buffer_size );
+    slot_capacity = memory->capacity;
 
-    /* ready to analyze request args passed in */
-    int arg_count = 0;
-    char req_args[ARG_LEN][ARG_BUF_LEN];
-    char *tok;
-    tok = strtok( tmp, " " );
+    return 0;
+}
 
-    /* Empty buffer to prevent problems */
-    for ( int i = 0; i < ARG_LEN; i++ )
+/**
+ * @brief Free every cached response.
+ */
+void free_response_cache()
+{
+    if ( status_cache != NULL )
     {
-        memset( req_args[i], 0, ARG_BUF_LEN );
+        for ( int i = 0; i < slot_capacity; i++ )
+        {
+            free( status_cache[i].data );
+        }
     }
 
-    /* now process args */
-    while ( tok != 0 && arg_count < ARG_LEN )
-    {
-        strncpy( req_args[arg_count], tok, strlen(tok) + 1 );
+    free( status_cache );
+    status_cache = NULL;
+    slot_capacity = 0;
 
-        tok = strtok( 0, " " );
+    free( list_cache.data );
+    memset( &list_cache, 0, sizeof(list_cache) );
+}
 
-        arg_count++;
-    }
+/**
+ * @brief The monotonic clock in seconds, for idle timers.
+ */
+static time_t monotonic_seconds()
+{
+    struct timespec ts;
 
-    // TRANSMIT custom_topic custom_message KL/version#
-    if ( strncasecmp(req_args[0], TRANSMIT, TRANSMIT_LEN) == 0 )
-    {
-#ifdef DEBUG
-        for ( int i = 0; i < arg_count; i++ )
-        {
-            printf( "%s\n", req_args[i] );
-        }
-#endif
+    clock_gettime( CLOCK_MONOTONIC, &ts );
 
-        /* Verify arg len */
-        if ( arg_count < TRANSMIT_ARG )
-        {
-            *n = snprintf( buf, MESSAGE_409_LEN, MESSAGE_409, KL_VERSION );
+    return ts.tv_sec;
+}
 
-            return rv;
-        }
+/**
+ * @brief Allocate the server's workers, `workers` of them, or one per
+ * online cpu if that is 0.
+ *
+ * @note Returns nonzero upon error. Call before the state applier starts,
+ * as it queues state changes for every worker.
+ */
+int initialize_workers()
+{
+    int count = conf->workers;
 
-        /* verify that protocol version is found */
-        if( get_protocol_version(req_args[arg_count - 1]) < 0.1 )
-        {
-            *n = snprintf( buf, MESSAGE_406_LEN, MESSAGE_406, KL_VERSION );
+    if ( count <= 0 )
+    {
+        count = (int)sysconf( _SC_NPROCESSORS_ONLN );
+        count = count > 0 ? count : 1;
+    }
 
-            return rv;
-        }
+    workers = (kl_worker *)calloc( count, sizeof(kl_worker) );
 
-        /* execute request */
-        mqtt_publish( cl, req_args[1], req_args[2], strlen(req_args[2]),
-                      MQTT_PUBLISH_QOS_0 );
+    if ( workers == NULL )
+    {
+        return 1;
+    }
 
-        /* verify results */
-        if ( cl->error != MQTT_OK )
+    for ( int i = 0; i < count; i++ )
+    {
+        kl_worker *w = &workers[i];
+
+        /* count it first, so free_workers() cleans up a partial one */
+        worker_count++;
+
+        pthread_mutex_init( &w->lock, NULL );
+        w->timerfd = -1;
+        w->epfd = epoll_create1( 0 );
+
+        /* close_socket() and the state applier write to this */
+        w->wakefd = eventfd( 0, EFD_NONBLOCK );
+        w->notify_slots = (int *)malloc( memory->capacity * sizeof(int) );
+        w->notify_work = (int *)malloc( memory->capacity * sizeof(int) );
+        w->notify_queued = (unsigned char *)calloc( memory->capacity,
+                                                    sizeof(unsigned char) );
+        w->work_size = memory->capacity;
+        w->push_buf = (char *)malloc( conf->buffer_size * sizeof(char) );
+
+        if ( w->epfd < 0 || w->wakefd < 0 || w->notify_slots == NULL ||
+             w->notify_work == NULL || w->notify_queued == NULL ||
+             w->push_buf == NULL )
         {
 #ifdef DEBUG
-            log_warn( "mqtt error: %s", mqtt_error_str(cl->error) );
+            log_error( "Unable to set up server worker %d", i );
 #endif
 
-            int len = strlen(mqtt_error_str(cl->error)) + MESSAGE_500_LEN;
-            *n = snprintf( buf, len, MESSAGE_500, KL_VERSION,
-                      mqtt_error_str(cl->error) );
-        }
-        else
-        {
-            int len = strlen(req_args[1]) + strlen(req_args[2]) +
-                      MESSAGE_205_LEN;
-            *n = snprintf( buf, len, MESSAGE_205, KL_VERSION,
-                      req_args[1], req_args[2] );
-        }
-    }
-    // TOGGLE dev_name KL/version#
-    else if ( strncasecmp(req_args[0], TOGGLE, TOGGLE_LEN) == 0 )
-    {
-#ifdef DEBUG
-        for ( int i = 0; i < arg_count; i++ )
-        {
-            printf( "%s\n", req_args[i] );
+            return 1;
         }
-#endif
 
-        /* Verify arg len */
-        if ( arg_count < TOGGLE_ARG )
-        {
-            *n = snprintf( buf, MESSAGE_409_LEN, MESSAGE_409, KL_VERSION );
+        w->listen_conn.worker = w;
+        w->unix_conn.worker = w;
+        w->wake_conn.fd = w->wakefd;
+        w->wake_conn.worker = w;
 
-            return rv;
-        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &w->wake_conn;
+        epoll_ctl( w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev );
 
-        /* verify that protocol version is found */
-        if( get_protocol_version(req_args[arg_count - 1]) < 0.1 )
+        if ( conf->idle_timeout <= 0 )
         {
-            *n = snprintf( buf, MESSAGE_406_LEN, MESSAGE_406, KL_VERSION );
-
-            return rv;
+            continue;
         }
 
-        /* execute request */
-        int status = toggle_dev_power( req_args[1], TOGGLE );
+        /* tick once a second to turn the idle timer wheel */
+        struct itimerspec its = {
+            .it_interval = { .tv_sec = 1, .tv_nsec = 0 },
+            .it_value = { .tv_sec = 1, .tv_nsec = 0 }
+        };
 
-        /* verify results */
-        if ( status )
-        {
-            int len = strlen(req_args[1]) + MESSAGE_404_LEN;
-            *n = snprintf( buf, len, MESSAGE_404, KL_VERSION, req_args[1] );
-        }
-        else
+        w->timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK );
+
+        if ( w->timerfd < 0 || timerfd_settime( w->timerfd, 0, &its, NULL ) )
         {
-            int len = strlen(req_args[1]) + MESSAGE_200_LEN;
-            *n = snprintf( buf, len, MESSAGE_200, KL_VERSION, req_args[1] );
-        }
-    }
-    // SET dev_name command message KL/version#
-    else if ( strncasecmp(req_args[0], SET_REQ, SET_REQ_LEN) == 0 )
-    {
 #ifdef DEBUG
-        for ( int i = 0; i < arg_count; i++ )
-        {
-            printf( "%s\n", req_args[i] );
-        }
+            log_error( "Unable to set up idle timer for worker %d", i );
 #endif
 
-        /* Verify arg len */
-        if ( arg_count < SET_ARG )
-        {
-            *n = snprintf( buf, MESSAGE_409_LEN, MESSAGE_409, KL_VERSION );
-
-            return rv;
+            return 1;
         }
 
-        /* verify that protocol version is found */
-        if( get_protocol_version(req_args[arg_count - 1]) < 0.1 )
-        {
-            *n = snprintf( buf, MESSAGE_406_LEN, MESSAGE_406, KL_VERSION );
+        w->now = monotonic_seconds();
+        w->tick = w->now;
+        w->timer_conn.fd = w->timerfd;
+        w->timer_conn.worker = w;
 
-            return rv;
-        }
+        ev.data.ptr = &w->timer_conn;
+        epoll_ctl( w->epfd, EPOLL_CTL_ADD, w->timerfd, &ev );
+    }
 
-        /* execute request */
-        int status = change_dev_state( req_args[1], req_args[2], req_args[3] );
+    return 0;
+}
 
-        /* verify results */
-        if ( status == 2)
-        {
-            int len = strlen(req_args[2]) + MESSAGE_405_LEN;
-            *n = snprintf( buf, len, MESSAGE_405, KL_VERSION, req_args[2] );
-        }
-        else if ( status == 1 )
+/**
+ * @brief Free every worker, once their threads are done.
+ */
+void free_workers()
+{
+    for ( int i = 0; i < worker_count; i++ )
+    {
+        kl_worker *w = &workers[i];
+
+        if ( w->wakefd >= 0 )
         {
-            int len = strlen(req_args[1]) + MESSAGE_404_LEN;
-            *n = snprintf( buf, len, MESSAGE_404, KL_VERSION, req_args[1] );
+            close( w->wakefd );
         }
-        else
+        if ( w->timerfd >= 0 )
         {
-            int len = strlen(req_args[1]) + strlen(req_args[2]) +
-                      strlen(req_args[3]) + MESSAGE_201_LEN;
-            *n = snprintf( buf, len, MESSAGE_201, KL_VERSION, req_args[1],
-                           req_args[2], req_args[3] );
+            close( w->timerfd );
         }
-    }
-    // ADD dev_name mqtt_topic dev_type <valid_cmnds> KL/version#
-    else if ( strncasecmp(req_args[0], ADD_REQ, ADD_REQ_LEN) == 0 )
-    {
-#ifdef DEBUG
-        for ( int i = 0; i < arg_count; i++ )
+        if ( w->epfd >= 0 )
         {
-            printf( "%s\n", req_args[i] );
+            close( w->epfd );
         }
-#endif
-        int id = atoi( req_args[3] );
-
-        /* Verify arg len */
-        switch( id )
-        {
-            case 1:
-            case 7:
-            {
-                if ( arg_count < ADD_ARGB )
-                {
-                    *n = snprintf( buf, MESSAGE_409_LEN,
-                                  MESSAGE_409, KL_VERSION );
 
-                    return rv;
-                }
+        pthread_mutex_destroy( &w->lock );
+        free( w->notify_slots );
+        free( w->notify_work );
+        free( w->notify_queued );
+        free( w->push_buf );
+    }
 
-                break;
-            }
+    free( workers );
+    workers = NULL;
+    worker_count = 0;
+}
 
-            default:
-            {
-                if ( arg_count < ADD_ARGA )
-                {
-                    *n = snprintf( buf, MESSAGE_409_LEN,
-                                  MESSAGE_409, KL_VERSION );
+/**
+ * @brief Mark a device as changed, so its cached responses are rendered
+ * again.
+ *
+ * @param slot the device's slot.
+ * @param listed nonzero if the dev_name, mqtt_topic or dev_type changed,
+ * which also changes the LIST response.
+ *
+ * @note Only call when holding the device table lock for writing.
+ */
+static void touch_device( const int slot, const int listed )
+{
+    DB_DEVICE(memory, slot)->version++;
 
-                    return rv;
-                }
+    if ( listed )
+    {
+        list_version++;
+    }
+}
 
-                break;
-            }
-        }
+/**
+ * @brief Store a rendered response in a cache entry.
+ *
+ * @param entry the cache entry.
+ * @param version the version the response was rendered from.
+ * @param data the response.
+ * @param len the response length.
+ *
+ * @note Only call when holding cache_lock. Nothing is cached if memory
+ * is short, the response just gets rendered again next time.
+ */
+static void fill_cache( kl_cache *entry, const unsigned int version,
+                        const char *data, const int len )
+{
+    if ( len > entry->size )
+    {
+        char *tmp = (char *)realloc( entry->data, len );
 
-        /* verify that protocol version is found */
-        if( get_protocol_version(req_args[arg_count - 1]) < 0.1 )
+        if ( tmp == NULL )
         {
-            *n = snprintf( buf, MESSAGE_406_LEN, MESSAGE_406, KL_VERSION );
-
-            return rv;
+            entry->len = 0;
+            return;
         }
 
-        /* execute request */
-        int status;
-        switch( id )
-        {
-            case 1:
-            case 7:
-            {
-                status = add_device( req_args[1], req_args[2],
-                                     id, req_args[4] );
-                break;
-            }
+        entry->data = tmp;
+        entry->size = len;
+    }
 
-            default:
-            {
-                status = add_device( req_args[1], req_args[2], id, NULL );
-                break;
-            }
-        }
+    memcpy( entry->data, data, len );
+    entry->len = len;
+    entry->version = version;
+}
 
-        /* verify results */
-        if ( status )
-        {
-            int len = strlen(req_args[1]) + MESSAGE_403_LEN;
-            *n = snprintf( buf, len, MESSAGE_403, KL_VERSION, req_args[1] );
-        }
-        else if ( status > 1 )
-        {
-            int len = strlen(req_args[1]) + MESSAGE_408_LEN;
-            *n = snprintf( buf, len, MESSAGE_408, KL_VERSION, req_args[1] );
-        }
-        else
+/**
+ * @brief Verify that the command is valid for a device.
+ *
+ * @param input the input command, case-insensitive.
+ * @param dev the device, its valid commands compiled in cmnds.
+ *
+ * @note Returns nonzero upon error.
+ */
+static int verify_command( const char *input, const db_data *dev )
+{
+    const db_detail *dd = dev->detail;
+
+    return !cmnd_set_has( &dd->cmnds, dd->valid_cmnds, input );
+}
+
+/*******************************************************************************
+ * Everything related to message parsing will reside here.
+ ******************************************************************************/
+
+/**
+ * @brief Check protocol version.
+ *
+ * @param buf the buffer that contains the protocol version.
+ *
+ * @note example being: KL/0.3 .
+ * Return protocol_version if valid
+ * or -1.0 if invalid.
+ */
+static float get_protocol_version(char *buf)
+{
+    float protocol = -1.0;
+
+    /*
+     * check to make sure buf isn't empty and first part equals KL or
+     * something along those lines
+     */
+    if ( strncasecmp( buf, "KL", 2) != 0 )
+    {
+        return protocol;
+    }
+
+    /* Now extract the protocol version itself */
+    if ( strncmp( buf, "kl", 2) == 0 )
+    {
+        sscanf( buf, "kl/%f", &protocol );
+    }
+    else if ( strncmp( buf, "Kl", 2) == 0 )
+    {
+        sscanf( buf, "Kl/%f", &protocol );
+    }
+    else if ( strncmp( buf, "kL", 2 ) == 0 )
+    {
+        sscanf( buf, "kL/%f", &protocol );
+    }
+    else
+    {
+        sscanf( buf, "KL/%f", &protocol );
+    }
+
+    /* make sure the protocol version is correct */
+    if ( protocol <= 0.0 )
+    {
+        return -1.0;
+    }
+
+    return protocol;
+}
+
+/**
+ * @brief Split a request into its arguments, in place.
+ *
+ * @param req the request, delimiters get overwritten with terminators.
+ * @param len the request length.
+ * @param args where the offset and length of every argument is recorded.
+ *
+ * @note Returns the argument count, anything past ARG_LEN is ignored.
+ */
+static int tokenize_request( char *req, const int len, kl_arg *args )
+{
+    int arg_count = 0;
+    int i = 0;
+
+    while ( i < len && arg_count < ARG_LEN )
+    {
+        /* skip over the delimiters */
+        while ( i < len && (req[i] == ' ' || req[i] == '\r'
+                         || req[i] == '\n') )
+        {
+            req[i++] = '\0';
+        }
+
+        if ( i >= len || req[i] == '\0' )
+        {
+            break;
+        }
+
+        args[arg_count].off = i;
+
+        while ( i < len && req[i] != ' ' && req[i] != '\r'
+                        && req[i] != '\n' && req[i] != '\0' )
+        {
+            i++;
+        }
+
+        args[arg_count].len = i - args[arg_count].off;
+        arg_count++;
+    }
+
+    /* terminate the last argument as well */
+    if ( i < len )
+    {
+        req[i] = '\0';
+    }
+
+    return arg_count;
+}
+
+/**
+ * @brief Hash a request verb, exact matches are checked afterwards.
+ *
+ * @param verb the verb, as sent in by the client.
+ * @param len the verb length.
+ *
+ * @note The verbs and UPDATE sub-verbs were picked so that this never
+ * collides within their table, masking it gives the table slot.
+ */
+static int verb_hash( const char *verb, const int len )
+{
+    return len + 5 * toupper( (unsigned char)verb[0] );
+}
+
+/**
+ * @brief Handle TRANSMIT custom_topic custom_message KL/version#
+ *
+ * @param c the connection the request came from.
+ * @param req_args the request args.
+ * @param args the slices of the request args, for their lengths.
+ * @param arg_count the request arg count.
+ * @param buf the response buffer, THIS GETS MODIFIED.
+ * @param n the response length, modified when buf is modified.
+ *
+ * @note Returns 0.
+ */
+static int handle_transmit( kl_conn *c, char **req_args, const kl_arg *args,
+                            const int arg_count, char *buf, int *n )
+{
+    (void)c;
+    (void)arg_count;
+
+    /*
+     * execute request, the client's error is only safe to read under its
+     * mutex, so go by what publishing returned instead
+     */
+    enum MQTTErrors err = mqtt_publish( cl, req_args[1], req_args[2],
+                                        args[2].len, MQTT_PUBLISH_QOS_0 );
+    wake_mqtt();
+
+    /* verify results */
+    if ( err != MQTT_OK )
+    {
+#ifdef DEBUG
+        log_warn( "mqtt error: %s", mqtt_error_str(err) );
+#endif
+
+        int len = strlen(mqtt_error_str(err)) + MESSAGE_500_LEN;
+        *n = snprintf( buf, len, MESSAGE_500, KL_VERSION,
+                  mqtt_error_str(err) );
+    }
+    else
+    {
+        int len = args[1].len + args[2].len + MESSAGE_205_LEN;
+        *n = snprintf( buf, len, MESSAGE_205, KL_VERSION,
+                  req_args[1], req_args[2] );
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Handle TOGGLE dev_name KL/version#
+ *
+ * @note Same params as handle_transmit(), returns 0.
+ */
+static int handle_toggle( kl_conn *c, char **req_args, const kl_arg *args,
+                          const int arg_count, char *buf, int *n )
+{
+    (void)c;
+    (void)arg_count;
+
+    /* execute request */
+    int status = toggle_dev_power( req_args[1], TOGGLE );
+
+    /* verify results */
+    if ( status == 2 )
+    {
+        int len = strlen( "unable to send to mqtt" ) + MESSAGE_500_LEN;
+        *n = snprintf( buf, len, MESSAGE_500, KL_VERSION,
+                       "unable to send to mqtt" );
+    }
+    else if ( status )
+    {
+        int len = args[1].len + MESSAGE_404_LEN;
+        *n = snprintf( buf, len, MESSAGE_404, KL_VERSION, req_args[1] );
+    }
+    else
+    {
+        int len = args[1].len + MESSAGE_200_LEN;
+        *n = snprintf( buf, len, MESSAGE_200, KL_VERSION, req_args[1] );
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Handle SET dev_name command message KL/version#
+ *
+ * @note Same params as handle_transmit(), returns 0.
+ */
+static int handle_set( kl_conn *c, char **req_args, const kl_arg *args,
+                       const int arg_count, char *buf, int *n )
+{
+    (void)c;
+    (void)arg_count;
+
+    /* execute request */
+    int status = change_dev_state( req_args[1], req_args[2], req_args[3] );
+
+    /* verify results */
+    if ( status == 2)
+    {
+        int len = args[2].len + MESSAGE_405_LEN;
+        *n = snprintf( buf, len, MESSAGE_405, KL_VERSION, req_args[2] );
+    }
+    else if ( status == 1 )
+    {
+        int len = args[1].len + MESSAGE_404_LEN;
+        *n = snprintf( buf, len, MESSAGE_404, KL_VERSION, req_args[1] );
+    }
+    else if ( status == 3 )
+    {
+        int len = strlen( "unable to send to mqtt" ) + MESSAGE_500_LEN;
+        *n = snprintf( buf, len, MESSAGE_500, KL_VERSION,
+                       "unable to send to mqtt" );
+    }
+    else
+    {
+        int len = args[1].len + args[2].len + args[3].len + MESSAGE_201_LEN;
+        *n = snprintf( buf, len, MESSAGE_201, KL_VERSION, req_args[1],
+                       req_args[2], req_args[3] );
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Handle ADD dev_name mqtt_topic dev_type <valid_cmnds> KL/version#
+ *
+ * @note Same params as handle_transmit(), returns 0.
+ */
+static int handle_add( kl_conn *c, char **req_args, const kl_arg *args,
+                       const int arg_count, char *buf, int *n )
+{
+    (void)c;
+
+    int id = atoi( req_args[3] );
+    int status;
+
+    /* names and topics must fit in the device table */
+    for ( int i = 1; i <= 2; i++ )
+    {
+        if ( args[i].len >= DB_DATA_LEN )
+        {
+            int len = args[i].len + MESSAGE_405_LEN;
+            *n = snprintf( buf, len, MESSAGE_405, KL_VERSION, req_args[i] );
+
+            return 0;
+        }
+    }
+
+    /* powerstrips and custom devices take an extra arg */
+    switch( id )
+    {
+        case 1:
+        case 7:
+        {
+            if ( arg_count < ADD_ARGB )
+            {
+                *n = snprintf( buf, MESSAGE_409_LEN,
+                              MESSAGE_409, KL_VERSION );
+
+                return 0;
+            }
+
+            status = add_device( req_args[1], req_args[2], id, req_args[4] );
+            break;
+        }
+
+        default:
+        {
+            status = add_device( req_args[1], req_args[2], id, NULL );
+            break;
+        }
+    }
+
+    /* verify results */
+    if ( status == 2 )
+    {
+        int len = args[1].len + MESSAGE_408_LEN;
+        *n = snprintf( buf, len, MESSAGE_408, KL_VERSION, req_args[1] );
+    }
+    else if ( status == 3 )
+    {
+        int len = strlen( "out of memory" ) + MESSAGE_500_LEN;
+        *n = snprintf( buf, len, MESSAGE_500, KL_VERSION, "out of memory" );
+    }
+    else if ( status )
+    {
+        int len = args[1].len + MESSAGE_403_LEN;
+        *n = snprintf( buf, len, MESSAGE_403, KL_VERSION, req_args[1] );
+    }
+    else
+    {
+        int len = args[1].len + MESSAGE_202_LEN;
+        *n = snprintf( buf, len, MESSAGE_202, KL_VERSION, req_args[1] );
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Handle DELETE dev_name KL/version#
+ *
+ * @note Same params as handle_transmit(), returns 0.
+ */
+static int handle_delete( kl_conn *c, char **req_args, const kl_arg *args,
+                          const int arg_count, char *buf, int *n )
+{
+    (void)c;
+    (void)arg_count;
+
+    /* execute request */
+    int status = delete_device( req_args[1] );
+
+    /* verify results */
+    if ( status )
+    {
+        int len = args[1].len + MESSAGE_402_LEN;
+        *n = snprintf( buf, len, MESSAGE_402, KL_VERSION, req_args[1] );
+    }
+    else
+    {
+        int len = args[1].len + MESSAGE_203_LEN;
+        *n = snprintf( buf, len, MESSAGE_203, KL_VERSION, req_args[1] );
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Handle UPDATE NAME old_dev_name new_dev_name KL/version#
+ * UPDATE TOPIC dev_name new_mqtt_topic KL/version#
+ * UPDATE STATE dev_name KL/version#
+ *
+ * @note Same params as handle_transmit(), returns 0.
+ */
+static int handle_update( kl_conn *c, char **req_args, const kl_arg *args,
+                          const int arg_count, char *buf, int *n )
+{
+    (void)c;
+    (void)arg_count;
+
+    /* sub-verbs, placed by verb_hash() */
+    static const kl_verb sub_verbs[UPDATE_TABLE_LEN] = {
+        { UPDATE_C, UPDATE_C_LEN, UPDATE_STATE, NULL },
+        { UPDATE_B, UPDATE_B_LEN, UPDATE_TOPIC, NULL },
+        { UPDATE_A, UPDATE_A_LEN, UPDATE_NAME, NULL },
+        { NULL, 0, 0, NULL }
+    };
+
+    int req = -1;
+
+    if ( args[1].len > 0 )
+    {
+        const kl_verb *v = &sub_verbs[verb_hash( req_args[1], args[1].len )
+                                      & (UPDATE_TABLE_LEN - 1)];
+
+        if ( v->name != NULL && v->len == args[1].len
+          && strncasecmp( req_args[1], v->name, v->len ) == 0 )
+        {
+            req = v->arg;
+        }
+    }
+
+    /* a new name or topic must fit in the device table */
+    if ( (req == UPDATE_NAME || req == UPDATE_TOPIC)
+      && args[3].len >= DB_DATA_LEN )
+    {
+        int len = args[3].len + MESSAGE_405_LEN;
+        *n = snprintf( buf, len, MESSAGE_405, KL_VERSION, req_args[3] );
+
+        return 0;
+    }
+
+    /* execute request */
+    int status = update_device( req, req_args[2], req_args[3], buf, n );
+
+    /* verify results */
+    if ( status == 2 )
+    {
+        int len = args[1].len + MESSAGE_405_LEN;
+        *n = snprintf( buf, len, MESSAGE_405, KL_VERSION, req_args[1] );
+    }
+    else if ( status == 1 )
+    {
+        int len = args[2].len + MESSAGE_404_LEN;
+        *n = snprintf( buf, len, MESSAGE_404, KL_VERSION, req_args[2] );
+    }
+    else if ( status == 3 )
+    {
+        int len = args[3].len + MESSAGE_408_LEN;
+        *n = snprintf( buf, len, MESSAGE_408, KL_VERSION, req_args[3] );
+    }
+    else if ( status == 4 )
+    {
+        int len = strlen( "out of memory" ) + MESSAGE_500_LEN;
+        *n = snprintf( buf, len, MESSAGE_500, KL_VERSION, "out of memory" );
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Parse a non-negative number passed in as a request arg.
+ *
+ * @param arg the request arg.
+ * @param dst where the number is stored.
+ *
+ * @note Returns nonzero upon error.
+ */
+static int parse_count( const char *arg, int *dst )
+{
+    char *end;
+    long val = strtol( arg, &end, 10 );
+
+    if ( end == arg || *end != '\0' || val < 0 || val > INT_MAX )
+    {
+        return 1;
+    }
+
+    *dst = (int)val;
+
+    return 0;
+}
+
+/**
+ * @brief Handle LIST <offset> <limit> <dev_type> KL/version#
+ * where the offset, limit and dev_type are all optional.
+ *
+ * @note Same params as handle_transmit(), returns 0.
+ */
+static int handle_list( kl_conn *c, char **req_args, const kl_arg *args,
+                        const int arg_count, char *buf, int *n )
+{
+    int opts[3] = { 0, 0, -1 }; /* offset, limit (0 for all) and dev_type */
+
+    /* everything between LIST and the protocol version */
+    for ( int i = 1; i < arg_count - 1 && i <= 3; i++ )
+    {
+        if ( parse_count( req_args[i], &opts[i - 1] )
+          || (i == 3 && opts[2] > DEV_TYPE_MAX) )
+        {
+            int len = args[i].len + MESSAGE_405_LEN;
+            *n = snprintf( buf, len, MESSAGE_405, KL_VERSION, req_args[i] );
+
+            return 0;
+        }
+    }
+
+    /* show the current devices to the client */
+    if ( dump_devices( c, opts[0], opts[1], opts[2], buf ) )
+    {
+        return -1;
+    }
+
+    *n = 0;
+
+    return 0;
+}
+
+/**
+ * @brief Handle STATUS dev_name KL/version#
+ *
+ * @note Same params as handle_transmit(), returns 0.
+ */
+static int handle_status( kl_conn *c, char **req_args, const kl_arg *args,
+                          const int arg_count, char *buf, int *n )
+{
+    (void)c;
+    (void)arg_count;
+
+    int status = get_dev_state( req_args[1], buf, n );
+
+    if ( status )
+    {
+        int len = args[1].len + MESSAGE_404_LEN;
+        *n = snprintf(buf, len, MESSAGE_404, KL_VERSION, req_args[1] );
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Start or stop pushing a device's state changes to a connection.
+ *
+ * @param c the watching connection.
+ * @param dv_name the dev_name, or WATCH_ALL for every device.
+ * @param on nonzero to watch, zero to stop watching.
+ *
+ * @note Returns 1 for no such device, returns 2 if memory is short,
+ * returns 0 otherwise.
+ */
+static int set_watch( kl_conn *c, const char *dv_name, const int on )
+{
+    int slot = -1; /* the device's slot, -1 for every device */
+    kl_worker *w = c->worker;
+
+    if ( strcmp( dv_name, WATCH_ALL ) != 0 )
+    {
+        /* held until the bit is set, so the device cannot be deleted */
+        pthread_rwlock_rdlock( lock );
+        slot = get_device_slot( dv_name );
+
+        if ( slot < 0 )
+        {
+            pthread_rwlock_unlock( lock );
+            return 1;
+        }
+    }
+
+    pthread_mutex_lock( &w->lock );
+
+    /* sized to the whole table, so it only grows after the table does */
+    if ( slot >= 0 && on && slot / 8 >= c->watch_size )
+    {
+        int size = (memory->capacity + 7) / 8;
+        unsigned char *watch = (unsigned char *)realloc( c->watch, size );
+
+        if ( watch == NULL )
+        {
+            pthread_mutex_unlock( &w->lock );
+            pthread_rwlock_unlock( lock );
+            return 2;
+        }
+
+        memset( watch + c->watch_size, 0, size - c->watch_size );
+        c->watch = watch;
+        c->watch_size = size;
+    }
+
+    int was_watching = c->watch_all || c->watched > 0;
+
+    if ( slot < 0 )
+    {
+        c->watch_all = on;
+    }
+    else if ( slot / 8 < c->watch_size )
+    {
+        unsigned char bit = 1 << (slot % 8);
+        int is_set = (c->watch[slot / 8] & bit) != 0;
+
+        if ( on && !is_set )
+        {
+            c->watch[slot / 8] |= bit;
+            c->watched++;
+        }
+        else if ( !on && is_set )
+        {
+            c->watch[slot / 8] &= ~bit;
+            c->watched--;
+        }
+    }
+
+    int watching = c->watch_all || c->watched > 0;
+
+    if ( watching != was_watching )
+    {
+        w->watch_count += watching ? 1 : -1;
+    }
+
+    pthread_mutex_unlock( &w->lock );
+
+    if ( slot >= 0 )
+    {
+        pthread_rwlock_unlock( lock );
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Stop every connection, on every worker, from watching a slot.
+ *
+ * @param slot the device's slot, about to be freed up.
+ *
+ * @note Only call when holding the device table lock for writing.
+ */
+static void unwatch_slot( const int slot )
+{
+    unsigned char bit = 1 << (slot % 8);
+
+    for ( int i = 0; i < worker_count; i++ )
+    {
+        kl_worker *w = &workers[i];
+
+        pthread_mutex_lock( &w->lock );
+
+        for ( kl_conn *c = w->connections; c != NULL; c = c->next )
+        {
+            if ( slot / 8 >= c->watch_size || !(c->watch[slot / 8] & bit) )
+            {
+                continue;
+            }
+
+            c->watch[slot / 8] &= ~bit;
+            c->watched--;
+
+            if ( !c->watch_all && c->watched == 0 )
+            {
+                w->watch_count--;
+            }
+        }
+
+        pthread_mutex_unlock( &w->lock );
+    }
+}
+
+/**
+ * @brief Handle WATCH dev_name KL/version#, or WATCH * KL/version#
+ *
+ * @note Same params as handle_transmit(), returns 0.
+ */
+static int handle_watch( kl_conn *c, char **req_args, const kl_arg *args,
+                         const int arg_count, char *buf, int *n )
+{
+    (void)arg_count;
+
+    int len;
+    int status = set_watch( c, req_args[1], 1 );
+
+    switch ( status )
+    {
+        case 0:
+            len = args[1].len + MESSAGE_212_LEN;
+            *n = snprintf( buf, len, MESSAGE_212, KL_VERSION, req_args[1] );
+            break;
+        case 1:
+            len = args[1].len + MESSAGE_404_LEN;
+            *n = snprintf( buf, len, MESSAGE_404, KL_VERSION, req_args[1] );
+            break;
+        default:
+            len = strlen( "out of memory" ) + MESSAGE_500_LEN;
+            *n = snprintf( buf, len, MESSAGE_500, KL_VERSION,
+                           "out of memory" );
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Handle UNWATCH dev_name KL/version#, or UNWATCH * KL/version#
+ *
+ * @note Same params as handle_transmit(), returns 0.
+ */
+static int handle_unwatch( kl_conn *c, char **req_args, const kl_arg *args,
+                           const int arg_count, char *buf, int *n )
+{
+    (void)arg_count;
+
+    int len;
+    int status = set_watch( c, req_args[1], 0 );
+
+    if ( status )
+    {
+        len = args[1].len + MESSAGE_404_LEN;
+        *n = snprintf( buf, len, MESSAGE_404, KL_VERSION, req_args[1] );
+    }
+    else
+    {
+        len = args[1].len + MESSAGE_213_LEN;
+        *n = snprintf( buf, len, MESSAGE_213, KL_VERSION, req_args[1] );
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Handle Q or QUIT, allowing the client to disconnect.
+ *
+ * @note Same params as handle_transmit(), returns -1.
+ */
+static int handle_quit( kl_conn *c, char **req_args, const kl_arg *args,
+                        const int arg_count, char *buf, int *n )
+{
+    (void)c;
+    (void)req_args;
+    (void)args;
+    (void)arg_count;
+
+    *n = snprintf( buf, MESSAGE_207_LEN, MESSAGE_207, KL_VERSION );
+
+    return -1;
+}
+
+/*
+ * Every request verb, placed by verb_hash(), with its minimum arg count.
+ * A minimum of zero skips the arg count and protocol version checks.
+ */
+static const kl_verb verbs[VERB_TABLE_LEN] = {
+    [ 0] = { LIST, LIST_LEN, LIST_ARG, handle_list },
+    [ 2] = { SET_REQ, SET_REQ_LEN, SET_ARG, handle_set },
+    [ 5] = { STATUS, STATUS_LEN, STATUS_ARG, handle_status },
+    [ 8] = { ADD_REQ, ADD_REQ_LEN, ADD_ARGA, handle_add },
+    [10] = { TOGGLE, TOGGLE_LEN, TOGGLE_ARG, handle_toggle },
+    [12] = { TRANSMIT, TRANSMIT_LEN, TRANSMIT_ARG, handle_transmit },
+    [15] = { UPDATE_REQ, UPDATE_REQ_LEN, UPDATE_ARG, handle_update },
+    [16] = { UNWATCH, UNWATCH_LEN, WATCH_ARG, handle_unwatch },
+    [22] = { QA, QA_LEN, 0, handle_quit },
+    [24] = { WATCH, WATCH_LEN, WATCH_ARG, handle_watch },
+    [25] = { QB, QB_LEN, 0, handle_quit },
+    [26] = { DEL_REQ, DEL_REQ_LEN, DELETE_ARG, handle_delete }
+};
+
+/**
+ * @brief Parse whatever the client sent in,
+ * Do the task if applicable,
+ * And send over the proper response.
+ *
+ * @param c the connection the request came from.
+ * @param req the request, THEN MODIFIED as it gets tokenized in place.
+ * @param req_len the request length, req[req_len] must be a terminator.
+ * @param buf the buffer the response is written to.
+ * @param n the response length, modified when buf is modified.
+ *
+ * @note Returns -1 when a user requests to quit, Returns 0 otherwise.
+ */
+static int parse_server_request( kl_conn *c, char *req, const int req_len,
+                                 char *buf, int *n )
+{
+    /* ready to analyze request args passed in */
+    kl_arg args[ARG_LEN];
+    int arg_count = tokenize_request( req, req_len, args );
+
+    /*
+     * point straight into the request, missing args are left pointing
+     * to its terminator so they read as empty strings.
+     */
+    char *req_args[ARG_LEN];
+
+    for ( int i = 0; i < ARG_LEN; i++ )
+    {
+        if ( i < arg_count )
+        {
+            req_args[i] = req + args[i].off;
+        }
+        else
+        {
+            req_args[i] = req + req_len;
+            args[i].len = 0;
+        }
+    }
+
+    *n = 0;
+
+    /* look up the verb, it has to match exactly */
+    const kl_verb *v = NULL;
+
+    if ( arg_count > 0 )
+    {
+        v = &verbs[verb_hash( req_args[0], args[0].len )
+                   & (VERB_TABLE_LEN - 1)];
+
+        if ( v->name == NULL || v->len != args[0].len
+          || strncasecmp( req_args[0], v->name, v->len ) != 0 )
+        {
+            v = NULL;
+        }
+    }
+
+    // Something else was passed in
+    if ( v == NULL )
+    {
+#ifdef DEBUG
+        printf( "passed in: %s\n", req_args[0] );
+#endif
+
+        *n = snprintf( buf, MESSAGE_400_LEN, MESSAGE_400, KL_VERSION );
+
+        return 0;
+    }
+
+#ifdef DEBUG
+    for ( int i = 0; i < arg_count; i++ )
+    {
+        printf( "%s\n", req_args[i] );
+    }
+#endif
+
+    if ( v->arg > 0 )
+    {
+        /* Verify arg len */
+        if ( arg_count < v->arg )
+        {
+            *n = snprintf( buf, MESSAGE_409_LEN, MESSAGE_409, KL_VERSION );
+
+            return 0;
+        }
+
+        /* verify that protocol version is found */
+        if( get_protocol_version(req_args[arg_count - 1]) < 0.1 )
+        {
+            *n = snprintf( buf, MESSAGE_406_LEN, MESSAGE_406, KL_VERSION );
+
+            return 0;
+        }
+    }
+
+    return v->handler( c, req_args, args, arg_count, buf, n );
+}
+
+/*******************************************************************************
+ * Everything related to the server will reside here.
+ ******************************************************************************/
+
+/**
+ * @brief Grow status_cache and every worker's notify queue to the device
+ * table's capacity, once get_free_slot() grew it.
+ *
+ * @note Returns nonzero upon error, leaving slot_capacity as it was.
+ * Only call when holding the device table lock for writing.
+ */
+static int fit_slot_tables()
+{
+    int capacity = memory->capacity;
+
+    /* readers of status_cache hold the device table lock too */
+    kl_cache *cache = (kl_cache *)realloc( status_cache,
+                                           capacity * sizeof(kl_cache) );
+
+    if ( cache == NULL )
+    {
+        return 1;
+    }
+
+    memset( cache + slot_capacity, 0,
+            (capacity - slot_capacity) * sizeof(kl_cache) );
+    status_cache = cache;
+
+    for ( int i = 0; i < worker_count; i++ )
+    {
+        kl_worker *w = &workers[i];
+
+        /* the state applier queues into these under the worker's lock */
+        pthread_mutex_lock( &w->lock );
+
+        int *slots = (int *)realloc( w->notify_slots,
+                                     capacity * sizeof(int) );
+
+        if ( slots != NULL )
+        {
+            w->notify_slots = slots;
+        }
+
+        unsigned char *queued = (unsigned char *)realloc( w->notify_queued,
+                                                          capacity );
+
+        if ( queued != NULL )
+        {
+            memset( queued + slot_capacity, 0, capacity - slot_capacity );
+            w->notify_queued = queued;
+        }
+
+        pthread_mutex_unlock( &w->lock );
+
+        if ( slots == NULL || queued == NULL )
+        {
+            return 1;
+        }
+    }
+
+    slot_capacity = capacity;
+
+    return 0;
+}
+
+/**
+ * @brief Function that adds a device to memory,
+ * then eventually the database.
+ *
+ * @param dv_name the device name of the new device
+ * @param mqtt_tpc the mqtt_topic associated with the new device
+ * @param dv_type the type of device the new device is
+ *
+ * @note
+ * Returns 2 for device already exists,
+ * returns 1 for failure to add device
+ * (usually because too many devices),
+ * returns 3 if its topic could not be routed, returns 0 otherwise.
+ */
+static int add_device( const char *dv_name, const char *mqtt_tpc,
+                       const int dv_type, const char *vld_cmds )
+{
+    int rv = 1; /* return value, assume too many devices */
+    int dup = 0; /* assume no dupes initially */
+    int loc = -1; /* assume no free space initially */
+
+    /* make sure dev_id is correct, return if not */
+    if ( dv_type > DEV_TYPE_MAX || dv_type < 0 )
+    {
+        return rv;
+    }
+
+    /*
+     * Fill in valid commands, depending on dev_type
+     */
+    char cmnds[DB_CMND_LEN];
+    memset( cmnds, 0, DB_CMND_LEN );
+
+    switch( dv_type )
+    {
+        case 0:
+        {
+            strncpy( cmnds, DEV_TYPE0_CMDS, DEV_TYPE0_CMDS_LEN );
+            break;
+        }
+
+        case 1:
+        {
+            int count = atoi( vld_cmds );
+            powerstrip_cmnd_cat( cmnds, count );
+            break;
+        }
+
+        case 2:
+        {
+            strncpy( cmnds, DEV_TYPE2_CMDS, DEV_TYPE2_CMDS_LEN );
+            break;
+        }
+
+        case 3:
+        {
+            strncpy( cmnds, DEV_TYPE3_CMDS, DEV_TYPE3_CMDS_LEN );
+            break;
+        }
+
+        case 4:
+        {
+            strncpy( cmnds, DEV_TYPE4_CMDS, DEV_TYPE4_CMDS_LEN );
+            break;
+        }
+
+        case 5:
+        {
+            strncpy( cmnds, DEV_TYPE5_CMDS, DEV_TYPE5_CMDS_LEN );
+            break;
+        }
+
+        case 6:
+        {
+            strncpy( cmnds, DEV_TYPE6_CMDS, DEV_TYPE6_CMDS_LEN );
+            break;
+        }
+
+        case 7:
+        {
+            strncpy( cmnds, vld_cmds, DB_CMND_LEN - 1 );
+            break;
+        }
+    }
+
+    /* the detail is set up before taking the lock, it is freed if unused */
+    db_detail *dd = new_db_detail( cmnds );
+
+    if ( dd == NULL )
+    {
+        return rv;
+    }
+
+    merge_dev_state( &dd->dev_state, DEV_STATE_TMPL, DV_STATE_TMPL_LEN - 1,
+                     NULL );
+
+    pthread_rwlock_wrlock( lock );
+
+    /* Check for a duplicate, then take a free spot */
+    if ( get_device_slot( dv_name ) >= 0 )
+    {
+        /* duplicate found */
+        dup = 1;
+        rv = 2;
+    }
+    else if ( (loc = get_free_slot()) >= 0 )
+    {
+        rv = 0;
+
+        /* the table may have just grown, with no room yet to track it */
+        if ( memory->capacity > slot_capacity && fit_slot_tables() )
+        {
+            put_free_slot( loc );
+            rv = 1;
+        }
+    }
+
+    /* only add if there does not exist a duplicate */
+    if ( !dup && rv == 0 )
+    {
+        /* Copy necessary information */
+        db_data *dev = DB_DEVICE(memory, loc);
+
+        snprintf( dev->dev_name, DB_DATA_LEN, "%s", dv_name );
+        snprintf( dev->mqtt_topic, DB_DATA_LEN, "%s", mqtt_tpc );
+
+        /* no room to index or route it, hand the slot back untouched */
+        if ( index_device_name( loc ) )
+        {
+            rv = 1;
+        }
+        else if ( add_topic_route( dev->mqtt_topic, loc ) )
+        {
+            unindex_device_name( dev->dev_name );
+            rv = 3;
+        }
+
+        if ( rv )
+        {
+            memset( dev->dev_name, 0, DB_DATA_LEN );
+            memset( dev->mqtt_topic, 0, DB_DATA_LEN );
+            put_free_slot( loc );
+        }
+    }
+
+    /* named and routed, fill in the rest */
+    if ( !dup && rv == 0 )
+    {
+        db_data *dev = DB_DEVICE(memory, loc);
+
+        dev->dev_type = dv_type;
+        dev->detail = dd;
+        dd = NULL;
+        touch_device( loc, 1 );
+
+        /* subscribe to this new device */
+        if ( !conf->wildcard_subscribe )
+        {
+            prepare_topic( topic, STAT, dev->mqtt_topic, (char *)RESULT );
+            mqtt_subscribe( cl, topic, 0 );
+            wake_mqtt();
+        }
+
+        /* request the current state if at all possible */
+        prepare_topic( topic, CMND, dev->mqtt_topic, (char *)STATE );
+        mqtt_publish( cl, topic, "", 0, MQTT_PUBLISH_QOS_0 );
+        wake_mqtt();
+
+        /* add this device to database! */
+        dev->to_change = 4;
+        queue_db_change( loc );
+
+        /* increment database count */
+        increment_db_count();
+
+        /* set return value to success */
+        rv = 0;
+    }
+
+    pthread_rwlock_unlock( lock );
+
+    /* a duplicate, or no room for it */
+    free( dd );
+
+    return rv;
+}
+
+/**
+ * @brief Function that adds a device to memory,
+ * then eventually the database.
+ *
+ * @param dv_name the device name of the device to remove
+ *
+ * @note Returns 1 for failure to delete device
+ * (usually because it does not exist), returns 0 otherwise.
+ */
+static int delete_device( char *dv_name )
+{
+    int rv = 1; /* return value */
+
+    pthread_rwlock_wrlock( lock );
+
+    /* look up the dev_name */
+    int i = get_device_slot( dv_name );
+
+    if ( i >= 0 )
+    {
+        db_data *dev = DB_DEVICE(memory, i);
+        db_detail *dd = dev->detail;
+
+        unindex_device_name( dev->dev_name );
+
+        /*
+         * Copy current information to old, and memset. If an update
+         * is still staged, old already holds what the database has.
+         */
+        if ( dd->odev_name[0] == '\0' )
+        {
+            strncpy( dd->odev_name, dev->dev_name,
+                     strlen(dev->dev_name) + 1 );
+        }
+        if ( dd->omqtt_topic[0] == '\0' )
+        {
+            strncpy( dd->omqtt_topic, dev->mqtt_topic,
+                     strlen(dev->mqtt_topic) + 1 );
+        }
+        memset( dev->dev_name, 0, DB_DATA_LEN );
+
+        /* unroute and unsubscribe from this device */
+        remove_topic_route( dev->mqtt_topic, i );
+
+        if ( !conf->wildcard_subscribe )
+        {
+            prepare_topic( topic, STAT, dev->mqtt_topic, (char *)RESULT );
+            mqtt_unsubscribe( cl, topic );
+            wake_mqtt();
+        }
+
+        memset( dev->mqtt_topic, 0, DB_DATA_LEN );
+
+        /* the slot may be reused, so stop watching it */
+        unwatch_slot( i );
+
+        /*
+         * delete this device from database!
+         * the slot is freed up once that is done.
+         */
+        dev->to_change = 5;
+        queue_db_change( i );
+        touch_device( i, 1 );
+
+        /* decrement database count */
+        decrement_db_count();
+
+        /* set return value to success */
+        rv = 0;
+    }
+
+    pthread_rwlock_unlock( lock );
+
+    return rv;
+}
+
+/**
+ * @brief Change either device's name, topic, or just get the full
+ * state of the device of interest.
+ *
+ *
+ * @param req the request, UPDATE_NAME, UPDATE_TOPIC or UPDATE_STATE,
+ * anything else is an invalid request.
+ * @param dev_name the dev_name of the device to be modified.
+ * @param arg the arg, could be new dev_name, new mqtt_topic, or just NULL.
+ * @param buf the buffer for the client, to make a tailor made response. In
+ * other words, THIS GETS MODIFIED.
+ * @param n the buffer length var. this also gets modified when buf gets
+ * modifed.
+ *
+ * @note Returns 1 for no such device, returns 2 for invalid request,
+ * returns 3 if the new dev_name is already taken, returns 4 if the new
+ * dev_name or mqtt_topic could not be indexed, returns 0 otherwise.
+ */
+static int update_device( const int req, const char *dev_name,
+                          const char *arg, char *buf, int *n )
+{
+    int rv = 0; /* return value */
+    int loc = -1; /* location of a device match */
+
+    /* check if req is invalid */
+    if ( req != UPDATE_NAME && req != UPDATE_TOPIC && req != UPDATE_STATE )
+    {
+        return 2;
+    }
+
+    pthread_rwlock_wrlock( lock );
+
+    /* look up the dev_name */
+    if ( (loc = get_device_slot( dev_name )) < 0 )
+    {
+        rv = 1;
+    }
+    /* the new dev_name must not belong to another device */
+    else if ( req == UPDATE_NAME
+           && get_device_slot( arg ) >= 0
+           && get_device_slot( arg ) != loc )
+    {
+        rv = 3;
+    }
+
+    if ( !rv )
+    {
+        db_data *dev = DB_DEVICE(memory, loc);
+        db_detail *dd = dev->detail;
+
+        /* Update dev_name */
+        if ( req == UPDATE_NAME )
+        {
+            char old[DB_DATA_LEN];
+            memcpy( old, dev->dev_name, DB_DATA_LEN );
+
+            memset( dev->dev_name, 0, DB_DATA_LEN );
+            snprintf( dev->dev_name, DB_DATA_LEN, "%s", arg );
+
+            /*
+             * the index ignores case, so only a new name needs an entry.
+             * It is added before the old one goes, so if that fails the
+             * device is left as it was.
+             */
+            if ( strcasecmp( old, arg ) != 0 )
+            {
+                if ( index_device_name( loc ) )
+                {
+                    memcpy( dev->dev_name, old, DB_DATA_LEN );
+                    pthread_rwlock_unlock( lock );
+                    return 4;
+                }
+
+                unindex_device_name( old );
+            }
+
+            if ( dd->odev_name[0] == '\0' )
+            {
+                strncpy( dd->odev_name, old, strlen(old) );
+            }
+            touch_device( loc, 1 );
+
+            /* set respective to_change value as needed */
+            switch( dev->to_change )
+            {
+                case -1:
+                case 1:
+                    dev->to_change = 1;
+                    break;
+
+                case 0:
+                {
+                    strncpy( dd->omqtt_topic,
+                             dev->mqtt_topic,
+                             strlen(dev->mqtt_topic) );
+
+                    /* stage to a full update */
+                    dev->to_change = 3;
+                    break;
+                }
+
+                case 2:
+                {
+                    /* stage to a full update */
+                    dev->to_change = 3;
+                    break;
+                }
+
+                default:
+                    break;
+            }
+
+            queue_db_change( loc );
+
+            int len = strlen(dd->odev_name) + strlen(arg) +
+                      MESSAGE_208_LEN;
+            *n = snprintf( buf, len, MESSAGE_208, KL_VERSION,
+                      dd->odev_name, arg );
+        }
+        /* Update mqtt topic */
+        else if ( req == UPDATE_TOPIC )
+        {
+            /*
+             * route the new topic before anything is sent, so if that
+             * fails the device is left as it was. The index ignores case,
+             * so the same topic keeps its route.
+             */
+            int moving = strcasecmp( dev->mqtt_topic, arg ) != 0;
+
+            if ( moving && add_topic_route( arg, loc ) )
+            {
+                pthread_rwlock_unlock( lock );
+                return 4;
+            }
+
+            char tmp[DB_DATA_LEN];
+            memset( tmp, 0, DB_DATA_LEN );
+
+            if ( dd->omqtt_topic[0] == '\0' )
+            {
+                /* Copy current mqtt topic to old */
+                strncpy( dd->omqtt_topic, dev->mqtt_topic,
+                         strlen(dev->mqtt_topic) );
+            }
+            else
+            {
+                /* copy whatever is the current mqtt topic to tmp */
+                strncpy( tmp, dev->mqtt_topic,
+                         strlen(dev->mqtt_topic) );
+            }
+
+            /* has not been called yet this db_updater cycle */
+            if ( tmp[0] == '\0')
+            {
+                /* Set the new topic using mqtt */
+                prepare_topic( topic, CMND, dd->omqtt_topic,
+                               (char *)MQTT_UPDATE );
+                mqtt_publish( cl, topic, arg, strlen(arg),
+                              MQTT_PUBLISH_QOS_0 );
+                wake_mqtt();
+
+                /* unsub from the old topic */
+                if ( !conf->wildcard_subscribe )
+                {
+                    prepare_topic( topic, STAT, dd->omqtt_topic,
+                                   (char *)RESULT );
+                    mqtt_unsubscribe( cl, topic );
+                    wake_mqtt();
+                }
+            }
+            /* has been called once this db_updater cycle already */
+            else
+            {
+                /* Set the new topic using mqtt */
+                prepare_topic( topic, CMND, tmp, (char *)MQTT_UPDATE );
+                mqtt_publish( cl, topic, arg, strlen(arg),
+                              MQTT_PUBLISH_QOS_0 );
+                wake_mqtt();
+
+                /* unsub from the old topic */
+                if ( !conf->wildcard_subscribe )
+                {
+                    prepare_topic( topic, STAT, tmp, (char *)RESULT );
+                    mqtt_unsubscribe( cl, topic );
+                    wake_mqtt();
+                }
+            }
+
+            /* the new topic is routed, memset mqtt_topic and copy it over */
+            if ( moving )
+            {
+                remove_topic_route( dev->mqtt_topic, loc );
+            }
+            memset( dev->mqtt_topic, 0, DB_DATA_LEN );
+            snprintf( dev->mqtt_topic, DB_DATA_LEN, "%s", arg );
+            touch_device( loc, 1 );
+
+            /* finally subscribe to the new topic */
+            if ( !conf->wildcard_subscribe )
+            {
+                prepare_topic( topic, STAT, arg, (char *)RESULT );
+                mqtt_subscribe( cl, topic, 0 );
+                wake_mqtt();
+            }
+
+            /* set respective to_change value as needed */
+            switch( dev->to_change )
+            {
+                case -1:
+                case 2:
+                    dev->to_change = 2;
+                    break;
+
+                case 0:
+                {
+                    strncpy( dd->odev_name,
+                             dev->dev_name,
+                             strlen(dev->dev_name) );
+
+                    /* stage to a full update */
+                    dev->to_change = 3;
+                    break;
+                }
+
+                case 1:
+                {
+                    /* stage to a full update */
+                    dev->to_change = 3;
+                    break;
+                }
+
+                default:
+                    break;
+            }
+
+            queue_db_change( loc );
+
+            int len = strlen(dev->dev_name) + strlen(arg) +
+                      MESSAGE_209_LEN;
+            *n = snprintf( buf, len, MESSAGE_209, KL_VERSION,
+                      dev->dev_name, arg );
+        }
+        /* Update dev_state via mqtt */
+        else if ( req == UPDATE_STATE )
+        {
+            prepare_topic( topic, CMND, dev->mqtt_topic,
+                           (char *)STATE );
+            mqtt_publish( cl, topic, "", 0, MQTT_PUBLISH_QOS_0 );
+            wake_mqtt();
+
+            /* set respective to_change value as needed */
+            switch( dev->to_change )
+            {
+                case -1:
+                case 0:
+                    dev->to_change = 0;
+                    break;
+
+                case 1:
+                {
+                    strncpy( dd->omqtt_topic,
+                             dev->mqtt_topic,
+                             strlen(dev->mqtt_topic) );
+
+                    /* stage to a full update */
+                    dev->to_change = 3;
+                    break;
+                }
+
+                case 2:
+                {
+                    strncpy( dd->odev_name,
+                             dev->dev_name,
+                             strlen(dev->dev_name) );
+
+                    /* stage to a full update */
+                    dev->to_change = 3;
+                    break;
+                }
+
+                default:
+                    break;
+            }
+
+            queue_db_change( loc );
+
+            int len = strlen(dev->dev_name) + MESSAGE_210_LEN;
+            *n = snprintf( buf, len, MESSAGE_210, KL_VERSION,
+                      dev->dev_name );
+        }
+    }
+
+    pthread_rwlock_unlock( lock );
+
+    return rv;
+}
+
+/**
+ * @brief Change device's state.
+ *
+ * @param dv_name the device name to change.
+ * @param cmd the device's command to be sent.
+ * @param msg the message to change dev state.
+ *
+ * @note Returns 1 for no such device, Returns 2 for invalid mqtt
+ * command, returns 3 if it could not be sent, otherwise returns 0.
+ */
+static int change_dev_state( const char *dv_name, const char *cmd, char *msg )
+{
+    int rv = 0; /* return value */
+    int loc = -1; /* location of a device match */
+
+    /* Only at this point is memory going to be accessed. */
+    pthread_rwlock_rdlock( lock );
+
+    /* look up the dev_name */
+    if ( (loc = get_device_slot( dv_name )) < 0 )
+    {
+        rv = 1;
+    }
+
+    /* only continue if a device is found */
+    if ( !rv )
+    {
+        /* verify cmd is acceptable for the device */
+        if ( verify_command( cmd, DB_DEVICE(memory, loc) ) )
+        {
+            rv = 2;
+        }
+
+        /* if the command is valid, ship it! */
+        if ( rv == 0 )
+        {
+            /* other readers may be preparing topics too */
+            char tpc[conf->topic_buff];
+
+            prepare_topic( tpc, CMND, DB_DEVICE(memory, loc)->mqtt_topic,
+                           (char *)cmd );
+
+            if ( mqtt_publish( cl, tpc, msg, strlen(msg),
+                               MQTT_PUBLISH_QOS_0 ) != MQTT_OK )
+            {
+                rv = 3;
+            }
+            wake_mqtt();
+        }
+    }
+
+    pthread_rwlock_unlock( lock );
+
+    return rv;
+}
+
+/**
+ * @brief Change device's power state.
+ *
+ * @param dv_name the device name to change.
+ * @param cmd the device's command to be sent.
+ * @param msg the message to change dev state.
+ *
+ * @note Returns 1 for no such device, returns 2 if it could not be sent,
+ * otherwise returns 0.
+ */
+static int toggle_dev_power( const char *dv_name, const char *msg )
+{
+    int rv = 0; /* return value */
+    int loc = -1; /* location of a device match */
+
+    /* Only at this point is memory going to be accessed. */
+    pthread_rwlock_rdlock( lock );
+
+    /* look up the dev_name */
+    if ( (loc = get_device_slot( dv_name )) < 0 )
+    {
+        rv = 1;
+    }
+
+    /* only continue if a device is found */
+    if ( !rv )
+    {
+        char cmd[DB_CMND_LEN];
+        memset( cmd, 0, DB_CMND_LEN );
+
+        /* other readers may be preparing topics too */
+        char tpc[conf->topic_buff];
+
+        const db_data *dev = DB_DEVICE(memory, loc);
+
+        /* if a powerstrip set to POWER0 */
+        if ( dev->dev_type == 1 )
+        {
+            snprintf( cmd, DEV_TYPE1B_CMD_LEN, DEV_TYPE1B_CMD, 0 );
+            prepare_topic( tpc, CMND, dev->mqtt_topic, cmd );
+        }
+        else
+        {
+            strncpy(cmd, DEV_TYPE0_CMDS, DEV_TYPE0_CMDS_LEN );
+            prepare_topic( tpc, CMND, dev->mqtt_topic, cmd );
+        }
+
+        if ( mqtt_publish( cl, tpc, msg, strlen(msg),
+                           MQTT_PUBLISH_QOS_0 ) != MQTT_OK )
+        {
+            rv = 2;
+        }
+        wake_mqtt();
+    }
+
+    pthread_rwlock_unlock( lock );
+
+    return rv;
+}
+
+/**
+ * @brief Render the full LIST response into list_cache.
+ *
+ * @note Only call when holding the device table lock and cache_lock.
+ * Returns nonzero upon error.
+ */
+static int render_device_list()
+{
+    int count = 0; /* devices to be listed */
+    int size = MESSAGE_204_LEN + get_digit_count( memory->capacity ) + 3;
+
+    /* size it up first, so it gets rendered in one go */
+    for ( int i = 0; i < memory->capacity; i++ )
+    {
+        const db_data *dev = DB_DEVICE(memory, i);
+
+        if ( dev->dev_name[0] == '\0' )
+        {
+            continue;
+        }
+
+        size += DUMP_204_LEN + strlen(dev->dev_name) +
+                strlen(dev->mqtt_topic) +
+                strlen(device_type_to_str( dev->dev_type ));
+        count++;
+    }
+
+    if ( size > list_cache.size )
+    {
+        char *tmp = (char *)realloc( list_cache.data, size );
+
+        if ( tmp == NULL )
+        {
+            list_cache.len = 0;
+            return 1;
+        }
+
+        list_cache.data = tmp;
+        list_cache.size = size;
+    }
+
+    /* create first part of message */
+    int used = snprintf( list_cache.data, size, MESSAGE_204,
+                         KL_VERSION, count );
+
+    for ( int i = 0; i < memory->capacity; i++ )
+    {
+        const db_data *dev = DB_DEVICE(memory, i);
+
+        /* Empty, move on */
+        if ( dev->dev_name[0] == '\0' )
+        {
+            continue;
+        }
+
+        used += snprintf( list_cache.data + used, size - used, DUMP_204,
+                          dev->dev_name, dev->mqtt_topic,
+                          device_type_to_str( dev->dev_type ) );
+    }
+
+    /* create a terminating line for this. */
+    used += snprintf( list_cache.data + used, size - used, ".\n" );
+
+    list_cache.len = used;
+    list_cache.version = list_version;
+
+    return 0;
+}
+
+/**
+ * @brief Function that prints devices in memory when requested to list
+ * devices by client.
+ *
+ * @param c the connection, the listing is queued to it in chunks.
+ * @param offset how many matching devices to skip.
+ * @param limit the most devices to list, 0 for no limit.
+ * @param dv_type only list devices of this dev_type, -1 for all of them.
+ * @param buf the connection's response buffer, used to render each chunk.
+ *
+ * @note The device count in the header is the number of devices listed.
+ * The full listing is cached until a device is added, removed, renamed
+ * or moved to another topic. Returns nonzero upon error.
+ */
+static int dump_devices( kl_conn *c, const int offset, const int limit,
+                         const int dv_type, char *buf )
+{
+    int rv = 0; /* return value */
+    int used = 0; /* bytes of buf rendered but not queued yet */
+    int count = 0; /* devices to be listed */
+    int skip = offset; /* matching devices still to be skipped */
+    const char *dv_str;
+
+    pthread_rwlock_rdlock( lock );
+
+    /* the full listing is served from list_cache while it's current */
+    if ( offset == 0 && limit == 0 && dv_type < 0 )
+    {
+        pthread_mutex_lock( &cache_lock );
+
+        if ( (list_cache.len > 0 && list_cache.version == list_version)
+          || !render_device_list() )
+        {
+            rv = queue_response( c, list_cache.data, list_cache.len );
+
+            pthread_mutex_unlock( &cache_lock );
+            pthread_rwlock_unlock( lock );
+
+            return rv;
+        }
+
+        /* short on memory, so render it piece by piece instead */
+        pthread_mutex_unlock( &cache_lock );
+    }
+
+    /* count first, the header comes before the devices */
+    for ( int i = 0; i < memory->capacity; i++ )
+    {
+        const db_data *dev = DB_DEVICE(memory, i);
+
+        if ( dev->dev_name[0] != '\0'
+          && (dv_type < 0 || dev->dev_type == dv_type) )
+        {
+            count++;
+        }
+    }
+
+    count = count > offset ? count - offset : 0;
+
+    if ( limit > 0 && count > limit )
+    {
+        count = limit;
+    }
+
+    /* create first part of message */
+    used = snprintf( buf, conf->buffer_size, MESSAGE_204, KL_VERSION, count );
+
+    for ( int i = 0; i < memory->capacity && count > 0; i++ )
+    {
+        const db_data *dev = DB_DEVICE(memory, i);
+
+        /* Empty or filtered out, move on */
+        if ( dev->dev_name[0] == '\0'
+          || (dv_type >= 0 && dev->dev_type != dv_type) )
+        {
+            continue;
+        }
+
+        if ( skip > 0 )
+        {
+            skip--;
+            continue;
+        }
+
+        dv_str = device_type_to_str( dev->dev_type );
+
+        int len = DUMP_204_LEN + strlen(dev->dev_name) +
+                  strlen(dev->mqtt_topic) + strlen(dv_str) - 1;
+
+        /* queue what's rendered so far once this row doesn't fit */
+        if ( used + len >= conf->buffer_size )
+        {
+            if ( (rv = queue_response( c, buf, used )) )
+            {
+                break;
+            }
+
+            used = 0;
+        }
+
+        used += snprintf( buf + used, conf->buffer_size - used, DUMP_204,
+                          dev->dev_name, dev->mqtt_topic, dv_str );
+
+        /* a single row longer than buf gets cut short */
+        if ( used >= conf->buffer_size )
         {
-            int len = strlen(req_args[1]) + MESSAGE_202_LEN;
-            *n = snprintf( buf, len, MESSAGE_202, KL_VERSION, req_args[1] );
+            used = conf->buffer_size - 1;
         }
+
+        count--;
+    }
+
+    pthread_rwlock_unlock( lock );
+
+    /* create a terminating line for this. */
+    if ( !rv && used + 2 >= conf->buffer_size )
+    {
+        rv = queue_response( c, buf, used );
+        used = 0;
+    }
+
+    if ( !rv )
+    {
+        used += snprintf( buf + used, conf->buffer_size - used, ".\n" );
+        rv = queue_response( c, buf, used );
+    }
+
+    return rv;
+}
+
+/**
+ * @brief Render a device's state, one line per valid command.
+ *
+ * @param loc the device's slot.
+ * @param header the first line, MESSAGE_206 or MESSAGE_211.
+ * @param buf the buffer for the rendered state, THIS GETS MODIFIED.
+ *
+ * @note Only call when holding the device table lock. Returns the rendered
+ * length, a state too long for buf gets cut short.
+ */
+static int render_dev_state( const int loc, const char *header, char *buf )
+{
+    const db_data *dev = DB_DEVICE(memory, loc);
+    const db_detail *dd = dev->detail;
+
+    /* create new temporary buffers */
+    char tmp_cmnds[DB_CMND_LEN];
+    char elem[JSON_LEN];
+
+    /* copy valid commands, ready to go. */
+    strncpy( tmp_cmnds, dd->valid_cmnds, DB_CMND_LEN - 1 );
+    tmp_cmnds[DB_CMND_LEN - 1] = '\0';
+
+    /* start with the desired message */
+    int used = snprintf( buf, conf->buffer_size, header,
+                         KL_VERSION, dev->dev_name );
+
+    char *tok;
+    char *save;
+    tok = strtok_r( tmp_cmnds, ",", &save );
+
+    while ( tok != 0 && used < conf->buffer_size )
+    {
+        find_dev_state( elem, JSON_LEN, tok, &dd->dev_state );
+        used += snprintf( buf + used, conf->buffer_size - used,
+                          STATE_206, tok, elem );
+
+        /* next on the list */
+        tok = strtok_r( 0, ",", &save );
     }
-    // DELETE dev_name KL/version#
-    else if ( strncasecmp(req_args[0], DEL_REQ, DEL_REQ_LEN) == 0 )
+
+    /* create a terminating line for this. */
+    if ( used < conf->buffer_size )
     {
-#ifdef DEBUG
-        for ( int i = 0; i < arg_count; i++ )
-        {
-            printf( "%s\n", req_args[i] );
-        }
-#endif
+        used += snprintf( buf + used, conf->buffer_size - used, ".\n" );
+    }
 
-        /* Verify arg len */
-        if ( arg_count < DELETE_ARG )
-        {
-            *n = snprintf( buf, MESSAGE_409_LEN, MESSAGE_409, KL_VERSION );
+    return used < conf->buffer_size ? used : conf->buffer_size - 1;
+}
 
-            return rv;
-        }
+/**
+ * @brief get current device's state.
+ *
+ * @param dv_name the device name of interest.
+ * @param buf the buffer for the client, to make a tailor made response. In
+ * other words, THIS GETS MODIFIED.
+ * @param n the buffer length var. this also gets modified when buf gets
+ * modifed.
+ *
+ * @note Returns 1 for no such device error, returns 0 otherwise.
+ */
+static int get_dev_state( const char *dv_name, char *buf, int *n )
+{
+    int rv = 1; /* return value */
+    int loc = -1; /* location of a device match */
 
-        /* verify that protocol version is found */
-        if( get_protocol_version(req_args[arg_count - 1]) < 0.1 )
+    pthread_rwlock_rdlock( lock );
+
+    /* look up the dev_name */
+    if ( (loc = get_device_slot( dv_name )) >= 0 )
+    {
+        rv = 0;
+    }
+
+    if ( !rv )
+    {
+        kl_cache *entry = &status_cache[loc];
+        unsigned int version = DB_DEVICE(memory, loc)->version;
+
+        pthread_mutex_lock( &cache_lock );
+
+        /* nothing changed since it was last rendered */
+        if ( entry->len > 0 && entry->version == version )
         {
-            *n = snprintf( buf, MESSAGE_406_LEN, MESSAGE_406, KL_VERSION );
+            memcpy( buf, entry->data, entry->len );
+            *n = entry->len;
+
+            pthread_mutex_unlock( &cache_lock );
+            pthread_rwlock_unlock( lock );
 
             return rv;
         }
 
-        /* execute request */
-        int status = delete_device( req_args[1] );
+        *n = render_dev_state( loc, MESSAGE_206, buf );
 
-        /* verify results */
-        if ( status )
-        {
-            int len = strlen(req_args[1]) + MESSAGE_402_LEN;
-            *n = snprintf( buf, len, MESSAGE_402, KL_VERSION, req_args[1] );
-        }
-        else
-        {
-            int len = strlen(req_args[1]) + MESSAGE_203_LEN;
-            *n = snprintf( buf, len, MESSAGE_203, KL_VERSION, req_args[1] );
-        }
+        fill_cache( entry, version, buf, *n );
+
+        pthread_mutex_unlock( &cache_lock );
     }
-    // UPDATE NAME old_dev_name new_dev_name KL/version#
-    // UPDATE TOPIC dev_name new_mqtt_topic KL/version#
-    // UPDATE STATE dev_name KL/version#
-    else if ( strncasecmp(req_args[0], UPDATE_REQ, UPDATE_REQ_LEN) == 0 )
+
+    pthread_rwlock_unlock( lock );
+
+    return rv;
+}
+
+/**
+ * @brief Queue a device state change on every worker with a connection
+ * watching anything.
+ *
+ * @param slot the device's slot.
+ *
+ * @note Called by the state applier, which then calls wake_workers().
+ */
+static void notify_watchers( const int slot )
+{
+    for ( int i = 0; i < worker_count; i++ )
     {
-#ifdef DEBUG
-        for ( int i = 0; i < arg_count; i++ )
+        kl_worker *w = &workers[i];
+
+        pthread_mutex_lock( &w->lock );
+
+        /* a slot already queued gets its latest state once it's pushed */
+        if ( w->watch_count > 0 && !w->notify_queued[slot] )
         {
-            printf( "%s\n", req_args[i] );
+            w->notify_queued[slot] = 1;
+            w->notify_slots[w->notify_count++] = slot;
+            w->notified = 1;
         }
-#endif
 
-        /* Verify arg len */
-        if ( arg_count < UPDATE_ARG )
-        {
-            *n = snprintf( buf, MESSAGE_409_LEN, MESSAGE_409, KL_VERSION );
+        pthread_mutex_unlock( &w->lock );
+    }
+}
 
-            return rv;
-        }
+/**
+ * @brief Wake every worker that notify_watchers() queued a change for.
+ */
+static void wake_workers()
+{
+    uint64_t one = 1;
 
-        /* verify that protocol version is found */
-        if( get_protocol_version(req_args[arg_count - 1]) < 0.1 )
+    for ( int i = 0; i < worker_count; i++ )
+    {
+        if ( workers[i].notified )
         {
-            *n = snprintf( buf, MESSAGE_406_LEN, MESSAGE_406, KL_VERSION );
+            workers[i].notified = 0;
 
-            return rv;
+            ssize_t n = write( workers[i].wakefd, &one, sizeof(one) );
+            (void)n;
         }
+    }
+}
+
+/**
+ * @brief Push every queued device state change to the worker's
+ * connections watching it.
+ *
+ * @param w the worker, woken up by wake_workers().
+ */
+static void push_notifications( kl_worker *w )
+{
+    int count;
+
+    /* take the queue, so the applier can keep filling it meanwhile */
+    pthread_mutex_lock( &w->lock );
 
-        /* execute request */
-        int status = update_device( req_args[1], req_args[2], req_args[3],
-                                    buf, n );
+    count = w->notify_count;
 
-        /* verify results */
-        if ( status == 2 )
+    /* the device table grew since notify_work was sized */
+    if ( count > w->work_size )
+    {
+        int *work = (int *)realloc( w->notify_work,
+                                    count * sizeof(int) );
+
+        if ( work != NULL )
         {
-            int len = strlen(req_args[1]) + MESSAGE_405_LEN;
-            *n = snprintf( buf, len, MESSAGE_405, KL_VERSION, req_args[1] );
+            w->notify_work = work;
+            w->work_size = count;
         }
-        else if ( status == 1 )
+        else
         {
-            int len = strlen(req_args[2]) + MESSAGE_404_LEN;
-            *n = snprintf( buf, len, MESSAGE_404, KL_VERSION, req_args[2] );
+            /* push what fits, and wake again for the rest */
+            uint64_t one = 1;
+            ssize_t n = write( w->wakefd, &one, sizeof(one) );
+            (void)n;
+
+            count = w->work_size;
         }
     }
-    // LIST KL/version#
-    else if ( strncasecmp(req_args[0], LIST, LIST_LEN) == 0 )
-    {
-#ifdef DEBUG
-        for ( int i = 0; i < arg_count; i++ )
-        {
-            printf( "%s\n", req_args[i] );
-        }
-#endif
 
-        /* Verify arg len */
-        if ( arg_count < LIST_ARG )
-        {
-            *n = snprintf( buf, MESSAGE_409_LEN, MESSAGE_409, KL_VERSION );
+    memcpy( w->notify_work, w->notify_slots, count * sizeof(int) );
 
-            return rv;
-        }
+    for ( int i = 0; i < count; i++ )
+    {
+        w->notify_queued[w->notify_work[i]] = 0;
+    }
 
-        /* verify that protocol version is found */
-        if( get_protocol_version(req_args[arg_count - 1]) < 0.1 )
-        {
-            *n = snprintf( buf, MESSAGE_406_LEN, MESSAGE_406, KL_VERSION );
+    w->notify_count -= count;
+    memmove( w->notify_slots, w->notify_slots + count,
+             w->notify_count * sizeof(int) );
 
-            return rv;
-        }
+    pthread_mutex_unlock( &w->lock );
 
-        /* show the current devices to the client */
-        dump_devices( buf, n );
-    }
-    // STATUS dev_name KL/version#
-    else if ( strncasecmp(req_args[0], STATUS, STATUS_LEN) == 0 )
+    for ( int i = 0; i < count; i++ )
     {
-#ifdef DEBUG
-        for ( int i = 0; i < arg_count; i++ )
+        int slot = w->notify_work[i];
+        int len = 0;
+
+        /* deleted since, its watchers were already dropped */
+        pthread_rwlock_rdlock( lock );
+
+        if ( DB_DEVICE(memory, slot)->dev_name[0] != '\0' )
         {
-            printf( "%s\n", req_args[i] );
+            len = render_dev_state( slot, MESSAGE_211, w->push_buf );
         }
-#endif
 
-        /* Verify arg len */
-        if ( arg_count < STATUS_ARG )
-        {
-            *n = snprintf( buf, MESSAGE_409_LEN, MESSAGE_409, KL_VERSION );
+        pthread_rwlock_unlock( lock );
 
-            return rv;
-        }
+        /* only this worker links or unlinks its connections */
+        kl_conn *c = w->connections;
 
-        /* verify that protocol version is found */
-        if( get_protocol_version(req_args[arg_count - 1]) < 0.1 )
+        while ( len > 0 && c != NULL )
         {
-            *n = snprintf( buf, MESSAGE_406_LEN, MESSAGE_406, KL_VERSION );
+            kl_conn *next = c->next;
 
-            return rv;
-        }
+            pthread_mutex_lock( &w->lock );
+            int watching = c->watch_all || (slot / 8 < c->watch_size &&
+                           (c->watch[slot / 8] & (1 << (slot % 8))));
+            pthread_mutex_unlock( &w->lock );
 
-        int status = get_dev_state( req_args[1], buf, n );
+            /*
+             * states are pushed whole, so a client too far behind
+             * just misses this one and catches up on the next.
+             */
+            if ( watching && c->queued < OUT_QUEUE_MAX )
+            {
+                if ( queue_response( c, w->push_buf, len ) ||
+                     flush_responses( c ) )
+                {
+                    close_connection( c );
+                }
+            }
 
-        if ( status )
-        {
-            int len = strlen(req_args[1]) + MESSAGE_404_LEN;
-            *n = snprintf(buf, len, MESSAGE_404, KL_VERSION, req_args[1] );
+            c = next;
         }
     }
-    // allow the client to disconnect
-    else if ( strncasecmp(req_args[0], QA, QA_LEN) == 0
-           || strncasecmp(req_args[0], QB, QB_LEN) == 0 )
+}
+
+/**
+ * @brief Create, Initialize, and return the server's socketfd.
+ *
+ * @param port the port the server listens on.
+ *
+ * @note Returns -1 if an error occurs, the actual integer otherwise.
+ */
+int create_server_socket( const int port )
+{
+    int fd;
+    struct sockaddr_in serv_addr;
+
+    /* actually create the socket here. */
+    fd = socket( AF_INET, SOCK_STREAM, 0 );
+
+    if ( fd < 0 )
     {
-        *n = snprintf( buf, MESSAGE_207_LEN, MESSAGE_207, KL_VERSION );
+#ifdef DEBUG
+        perror( "error creating socket" );
+        log_error( "error creating socket" );
+#endif
 
-        rv = -1;
+        return -1;
     }
-    // Something else was passed in
-    else
+
+    /* set serv_addr to 0 initially. */
+    memset( &serv_addr, 0, sizeof(serv_addr) );
+
+    serv_addr.sin_family = AF_INET;
+
+    /* allow anyone and anything to connect .. for now. */
+    serv_addr.sin_addr.s_addr = htonl( INADDR_ANY );
+    //inet_pton( AF_INET, IP_ADDR, &serv_addr.sin_addr );
+
+#ifdef DEBUG
+    log_debug( "using port %u for server", (port & 0xffff) );
+#endif
+
+    serv_addr.sin_port = htons( port & 0xffff );
+
+    /* Bind the fd */
+    if ( bind( fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr) ) < 0 )
     {
 #ifdef DEBUG
-        printf( "passed in: %s\n", req_args[0] );
+        perror( "Error binding" );
+        log_error( "Error binding server socket" );
 #endif
 
-        *n = snprintf( buf, MESSAGE_400_LEN, MESSAGE_400, KL_VERSION );
+        fd = -1;
     }
 
-    return rv;
+    /* Return the completed process. */
+    return fd;
 }
 
-/*******************************************************************************
- * Everything related to the server will reside here.
- ******************************************************************************/
-
 /**
- * @brief Function that adds a device to memory,
- * then eventually the database.
+ * @brief Make way for the unix domain socket, by removing a stale one
+ * that a previous run did not exit cleanly enough to remove.
  *
- * @param dv_name the device name of the new device
- * @param mqtt_tpc the mqtt_topic associated with the new device
- * @param dv_type the type of device the new device is
+ * @param path where the socket is to be created.
+ * @param addr the address of the socket, for path.
  *
- * @note
- * Returns 2 for device already exists,
- * returns 1 for failure to add device
- * (usually because too many devices), returns 0 otherwise.
+ * @note Returns nonzero if something other than a stale socket is there,
+ * such as a regular file, or a socket some server still listens on.
  */
-static int add_device( const char *dv_name, const char *mqtt_tpc,
-                       const int dv_type, const char *vld_cmds )
+static int remove_stale_socket( const char *path,
+                                const struct sockaddr_un *addr )
 {
-    int rv = 1; /* return value, assume too many devices */
-    int dup = 0; /* assume no dupes initially */
-    int loc = -1; /* assume no free space initially */
+    struct stat st;
 
-    /* make sure dev_id is correct, return if not */
-    if ( dv_type > DEV_TYPE_MAX || dv_type < 0 )
+    if ( lstat( path, &st ) < 0 )
     {
-        return rv;
+        /* nothing there to remove */
+        return errno != ENOENT;
     }
 
-    sem_wait( mutex );
-    pthread_mutex_lock( lock );
-
-    /* Scan for an empty spot, check for duplicates */
-    for ( int i = 0; i < conf->max_dev_count; i++ )
+    if ( !S_ISSOCK(st.st_mode) )
     {
-        /* Check for a duplicate */
-        if ( strncasecmp( memory[i].dev_name, dv_name,
-             strlen(dv_name)) == 0 )
-        {
-            /* duplicate found */
-            dup = 1;
-            rv = 2;
-            break;
-        }
+#ifdef DEBUG
+        log_error( "unix_socket path %s exists and is not a socket", path );
+#endif
 
-        /* take the first found free spot */
-        if ( memory[i].dev_name[0] == '\0' && loc == -1 )
-        {
-            rv = 0;
-            loc = i;
-        }
+        return 1;
     }
 
-    /* only add if there does not exist a duplicate */
-    if ( !dup && rv == 0 )
-    {
-        /* Copy necessary information */
-        strncpy( memory[loc].dev_name, dv_name, strlen(dv_name) + 1 );
-        strncpy( memory[loc].mqtt_topic, mqtt_tpc, strlen(mqtt_tpc) + 1 );
-        memory[loc].dev_type = dv_type;
-        strncpy( memory[loc].dev_state, DEV_STATE_TMPL, DV_STATE_TMPL_LEN );
-
-        /*
-         * Fill in valid commands, depending on dev_type
-         */
-        switch( memory[loc].dev_type )
-        {
-            case 0:
-            {
-                strncpy( memory[loc].valid_cmnds, DEV_TYPE0_CMDS,
-                         DEV_TYPE0_CMDS_LEN );
-                break;
-            }
-
-            case 1:
-            {
-                int count = atoi( vld_cmds );
-                powerstrip_cmnd_cat( memory[loc].valid_cmnds, count );
-                break;
-            }
-
-            case 2:
-            {
-                strncpy( memory[loc].valid_cmnds, DEV_TYPE2_CMDS,
-                         DEV_TYPE2_CMDS_LEN );
-                break;
-            }
-
-            case 3:
-            {
-                strncpy( memory[loc].valid_cmnds, DEV_TYPE3_CMDS,
-                         DEV_TYPE3_CMDS_LEN );
-                break;
-            }
-
-            case 4:
-            {
-                strncpy( memory[loc].valid_cmnds, DEV_TYPE4_CMDS,
-                         DEV_TYPE4_CMDS_LEN );
-                break;
-            }
-
-            case 5:
-            {
-                strncpy( memory[loc].valid_cmnds, DEV_TYPE5_CMDS,
-                         DEV_TYPE5_CMDS_LEN );
-                break;
-            }
-
-            case 6:
-            {
-                strncpy( memory[loc].valid_cmnds, DEV_TYPE6_CMDS,
-                         DEV_TYPE6_CMDS_LEN );
-                break;
-            }
-
-            case 7:
-            {
-                strncpy( memory[loc].valid_cmnds, vld_cmds,
-                         strlen(vld_cmds) + 1 );
-                break;
-            }
-        }
+    /* a socket no one listens on refuses, anything else is left alone */
+    int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0 );
 
-        /* subscribe to this new device */
-        prepare_topic( STAT, memory[loc].mqtt_topic, (char *)RESULT );
-        mqtt_subscribe( cl, topic, 0 );
+    if ( fd < 0 )
+    {
+        return 1;
+    }
 
-        /* request the current state if at all possible */
-        prepare_topic( CMND, memory[loc].mqtt_topic, (char *)STATE );
-        mqtt_publish( cl, topic, "", 0, MQTT_PUBLISH_QOS_0 );
+    int rv = connect( fd, (const struct sockaddr *)addr, sizeof(*addr) );
+    int refused = ( rv < 0 && errno == ECONNREFUSED );
 
-        /* add this device to database! */
-        to_change[loc] = 4;
+    close( fd );
 
-        /* increment database count */
-        increment_db_count();
+    if ( !refused )
+    {
+#ifdef DEBUG
+        log_error( "unix_socket %s is still in use", path );
+#endif
 
-        /* set return value to success */
-        rv = 0;
+        return 1;
     }
 
-    pthread_mutex_unlock( lock );
-    sem_post( mutex );
-
-    return rv;
+    return unlink( path ) < 0 && errno != ENOENT;
 }
 
 /**
- * @brief Function that adds a device to memory,
- * then eventually the database.
+ * @brief Create, Initialize, and return the socketfd for local clients.
  *
- * @param dv_name the device name of the device to remove
+ * @param path where the socket is created, replacing any stale one
+ * left behind, but never anything else.
  *
- * @note Returns 1 for failure to delete device
- * (usually because it does not exist), returns 0 otherwise.
+ * @note Returns -1 if an error occurs, the actual integer otherwise.
  */
-static int delete_device( char *dv_name )
+int create_unix_socket( const char *path )
 {
-    int rv = 1; /* return value */
+    int fd;
+    struct sockaddr_un serv_addr;
+
+    if ( strlen(path) >= sizeof(serv_addr.sun_path) )
+    {
+#ifdef DEBUG
+        log_error( "unix_socket path %s is too long", path );
+#endif
 
-    sem_wait( mutex );
-    pthread_mutex_lock( lock );
+        return -1;
+    }
 
-    /* scan for a dev_name match */
-    for ( int i = 0; i < conf->max_dev_count; i++ )
+    fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+
+    if ( fd < 0 )
     {
-        if ( strncasecmp(memory[i].dev_name, dv_name, strlen(dv_name)) == 0 )
-        {
-            /* Copy current information to old, and memset */
-            strncpy( memory[i].odev_name, memory[i].dev_name,
-                     strlen(memory[i].dev_name) + 1 );
-            strncpy( memory[i].omqtt_topic, memory[i].mqtt_topic,
-                     strlen(memory[i].mqtt_topic) + 1 );
-            memset( memory[i].dev_name, 0, DB_DATA_LEN );
-            memset( memory[i].mqtt_topic, 0, DB_DATA_LEN );
+#ifdef DEBUG
+        perror( "error creating unix socket" );
+        log_error( "error creating unix socket" );
+#endif
 
-            /* unsubscribe from this device */
-            prepare_topic( STAT, memory[i].omqtt_topic, (char *)RESULT );
-            mqtt_unsubscribe( cl, topic );
+        return -1;
+    }
 
-            /* delete this device from database! */
-            to_change[i] = 5;
+    memset( &serv_addr, 0, sizeof(serv_addr) );
+    serv_addr.sun_family = AF_UNIX;
+    strncpy( serv_addr.sun_path, path, sizeof(serv_addr.sun_path) - 1 );
 
-            /* decrement database count */
-            decrement_db_count();
+    if ( remove_stale_socket( path, &serv_addr ) )
+    {
+        close( fd );
+        return -1;
+    }
 
-            /* set return value to success */
-            rv = 0;
+    if ( bind( fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr) ) < 0 )
+    {
+#ifdef DEBUG
+        perror( "Error binding" );
+        log_error( "Error binding unix socket %s", path );
+#endif
 
-            /* all done */
-            break;
-        }
+        close( fd );
+        fd = -1;
     }
 
-    pthread_mutex_unlock( lock );
-    sem_post( mutex );
+    return fd;
+}
+
+/**
+ * @brief Put a connection's idle timer in the wheel.
+ *
+ * @param w the connection's worker.
+ * @param c the connection, not already in the wheel.
+ * @param expiry the second it times out, or is checked again.
+ */
+static void wheel_insert( kl_worker *w, kl_conn *c, const time_t expiry )
+{
+    c->wheel_slot = expiry & (WHEEL_SLOTS - 1);
+    c->wheel_prev = NULL;
+    c->wheel_next = w->wheel[c->wheel_slot];
 
-    return rv;
+    if ( c->wheel_next != NULL )
+    {
+        c->wheel_next->wheel_prev = c;
+    }
+
+    w->wheel[c->wheel_slot] = c;
 }
 
 /**
- * @brief Change either device's name, topic, or just get the full
- * state of the device of interest.
+ * @brief Take a connection's idle timer out of the wheel.
  *
+ * @param w the connection's worker.
+ * @param c the connection, a wheel_slot of -1 means it's not in the wheel.
+ */
+static void wheel_remove( kl_worker *w, kl_conn *c )
+{
+    if ( c->wheel_slot < 0 )
+    {
+        return;
+    }
+
+    if ( c->wheel_prev != NULL )
+    {
+        c->wheel_prev->wheel_next = c->wheel_next;
+    }
+    else
+    {
+        w->wheel[c->wheel_slot] = c->wheel_next;
+    }
+
+    if ( c->wheel_next != NULL )
+    {
+        c->wheel_next->wheel_prev = c->wheel_prev;
+    }
+}
+
+/**
+ * @brief Allocate a connection's state and register it with epoll.
  *
- * @param req the request, expected to be "NAME", "TOPIC", or "STATE".
- * @param dev_name the dev_name of the device to be modified.
- * @param arg the arg, could be new dev_name, new mqtt_topic, or just NULL.
- * @param buf the buffer for the client, to make a tailor made response. In
- * other words, THIS GETS MODIFIED.
- * @param n the buffer length var. this also gets modified when buf gets
- * modifed.
+ * @param w the worker the connection is served by.
+ * @param fd the client's fd, as returned by accept().
  *
- * @note Returns 1 for no such device, returns 2 for invalid request,
- * returns 0 otherwise.
+ * @note Returns NULL if an error occurs, the new connection otherwise.
  */
-static int update_device( const char *req, const char *dev_name,
-                          const char *arg, char *buf, int *n )
+static kl_conn *open_connection( kl_worker *w, const int fd )
 {
-    int rv = 0; /* return value */
-    int loc = -1; /* location of a device match */
+    kl_conn *c = (kl_conn *)malloc( sizeof(kl_conn) );
 
-    /* check if req is invalid */
-    if ( strncasecmp( req, UPDATE_A, UPDATE_A_LEN) != 0
-      && strncasecmp( req, UPDATE_B, UPDATE_B_LEN) != 0
-      && strncasecmp( req, UPDATE_C, UPDATE_C_LEN) != 0 )
+    if ( c == NULL )
     {
-        return 2;
+        return NULL;
     }
 
-    sem_wait( mutex );
-    pthread_mutex_lock( lock );
+    /* responses are queued rather than blocking the worker */
+    fcntl( fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK );
+
+    c->fd = fd;
+    c->len = 0;
+    c->discard = 0;
+    c->head = NULL;
+    c->tail = NULL;
+    c->queued = 0;
+    c->watch = NULL;
+    c->watch_size = 0;
+    c->watched = 0;
+    c->watch_all = 0;
+    c->worker = w;
+    c->wheel_slot = -1;
+    c->buf = (char *)malloc( conf->buffer_size * sizeof(char) );
+
+    if ( c->buf == NULL )
+    {
+        free( c );
+        return NULL;
+    }
 
-    /* scan for a dev_name match */
-    for ( int i = 0; i < conf->max_dev_count; i++ )
+    /* responses get their own buffer, requests are parsed in place */
+    c->out = (char *)malloc( conf->buffer_size * sizeof(char) );
+
+    if ( c->out == NULL )
     {
-        if ( strncasecmp(memory[i].dev_name, dev_name, strlen(dev_name)) == 0 )
-        {
-            loc = i;
-            break;
-        }
+        free( c->buf );
+        free( c );
+        return NULL;
+    }
 
-        /* No matches at all? all done */
-        if ( i == (conf->max_dev_count - 1) )
-        {
-            rv = 1;
-        }
+    /*
+     * edge-triggered, so the handler must read until EAGAIN, and is only
+     * told about writability again once a full socket buffer drains.
+     */
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+
+    if ( epoll_ctl( w->epfd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+    {
+#ifdef DEBUG
+        log_error( "Unable to add client to epoll" );
+#endif
+
+        free( c->out );
+        free( c->buf );
+        free( c );
+        return NULL;
     }
 
-    if ( !rv )
+    /* link it in with the worker's other connections */
+    pthread_mutex_lock( &w->lock );
+
+    c->prev = NULL;
+    c->next = w->connections;
+
+    if ( w->connections != NULL )
     {
-        /* Update dev_name */
-        if ( strncasecmp(req, UPDATE_A, UPDATE_A_LEN) == 0 )
-        {
-            if ( memory[loc].odev_name[0] == '\0' )
-            {
-                strncpy( memory[loc].odev_name, dev_name, strlen(dev_name) );
-            }
-            memset( memory[loc].dev_name, 0, DB_DATA_LEN );
-            strncpy( memory[loc].dev_name, arg, strlen(arg) );
+        w->connections->prev = c;
+    }
 
-            /* set respective to_change value as needed */
-            switch( to_change[loc] )
-            {
-                case -1:
-                case 1:
-                    to_change[loc] = 1;
-                    break;
+    w->connections = c;
 
-                case 0:
-                {
-                    strncpy( memory[loc].omqtt_topic,
-                             memory[loc].mqtt_topic,
-                             strlen(memory[loc].mqtt_topic) );
+    pthread_mutex_unlock( &w->lock );
 
-                    /* stage to a full update */
-                    to_change[loc] = 3;
-                    break;
-                }
+    if ( conf->idle_timeout > 0 )
+    {
+        c->last_active = w->now;
+        wheel_insert( w, c, w->now + conf->idle_timeout );
+    }
 
-                case 2:
-                {
-                    /* stage to a full update */
-                    to_change[loc] = 3;
-                    break;
-                }
+    return c;
+}
 
-                default:
-                    break;
-            }
+/**
+ * @brief Close a connection and free its state.
+ *
+ * @param c the connection to be closed, no longer valid afterwards.
+ *
+ * @note closing the fd also removes it from epoll.
+ */
+static void close_connection( kl_conn *c )
+{
+    kl_worker *w = c->worker;
 
-            int len = strlen(memory[loc].odev_name) + strlen(arg) +
-                      MESSAGE_208_LEN;
-            *n = snprintf( buf, len, MESSAGE_208, KL_VERSION,
-                      memory[loc].odev_name, arg );
-        }
-        /* Update mqtt topic */
-        else if ( strncasecmp(req, UPDATE_B, UPDATE_B_LEN) == 0 )
-        {
-            char tmp[DB_DATA_LEN];
-            memset( tmp, 0, DB_DATA_LEN );
+    close( c->fd );
 
-            if ( memory[loc].omqtt_topic[0] == '\0' )
-            {
-                /* Copy current mqtt topic to old */
-                strncpy( memory[loc].omqtt_topic, memory[loc].mqtt_topic,
-                         strlen(memory[loc].mqtt_topic) );
-            }
-            else
-            {
-                /* copy whatever is the current mqtt topic to tmp */
-                strncpy( tmp, memory[loc].mqtt_topic,
-                         strlen(memory[loc].mqtt_topic) );
-            }
+    /* other workers walk the watch sets when a device is deleted */
+    pthread_mutex_lock( &w->lock );
 
-            /* has not been called yet this db_updater cycle */
-            if ( tmp[0] == '\0')
-            {
-                /* Set the new topic using mqtt */
-                prepare_topic( CMND, memory[loc].omqtt_topic,
-                               (char *)MQTT_UPDATE );
-                mqtt_publish( cl, topic, arg, strlen(arg),
-                              MQTT_PUBLISH_QOS_0 );
+    if ( c->prev != NULL )
+    {
+        c->prev->next = c->next;
+    }
+    else
+    {
+        w->connections = c->next;
+    }
 
-                /* unsub from the old topic */
-                prepare_topic( STAT, memory[loc].omqtt_topic, (char *)RESULT );
-                mqtt_unsubscribe( cl, topic );
-            }
-            /* has been called once this db_updater cycle already */
-            else
-            {
-                /* Set the new topic using mqtt */
-                prepare_topic( CMND, tmp, (char *)MQTT_UPDATE );
-                mqtt_publish( cl, topic, arg, strlen(arg),
-                              MQTT_PUBLISH_QOS_0 );
+    if ( c->next != NULL )
+    {
+        c->next->prev = c->prev;
+    }
 
-                /* unsub from the old topic */
-                prepare_topic( STAT, tmp, (char *)RESULT );
-                mqtt_unsubscribe( cl, topic );
-            }
+    if ( c->watch_all || c->watched > 0 )
+    {
+        w->watch_count--;
+    }
 
-            /* memset mqtt_topic and copy new topic over */
-            memset( memory[loc].mqtt_topic, 0, DB_DATA_LEN );
-            strncpy( memory[loc].mqtt_topic, arg, strlen(arg) );
+    pthread_mutex_unlock( &w->lock );
 
-            /* finally subscribe to the new topic */
-            prepare_topic( STAT, arg, (char *)RESULT );
-            mqtt_subscribe( cl, topic, 0 );
+    pthread_mutex_lock( &client_lock );
+    client_count--;
+    pthread_mutex_unlock( &client_lock );
 
-            /* set respective to_change value as needed */
-            switch( to_change[loc] )
-            {
-                case -1:
-                case 2:
-                    to_change[loc] = 2;
-                    break;
+    if ( conf->idle_timeout > 0 )
+    {
+        wheel_remove( w, c );
+    }
 
-                case 0:
-                {
-                    strncpy( memory[loc].odev_name,
-                             memory[loc].dev_name,
-                             strlen(memory[loc].dev_name) );
+    free( c->watch );
 
-                    /* stage to a full update */
-                    to_change[loc] = 3;
-                    break;
-                }
+    while ( c->head != NULL )
+    {
+        kl_out *o = c->head;
+        c->head = o->next;
+        free( o );
+    }
 
-                case 1:
-                {
-                    /* stage to a full update */
-                    to_change[loc] = 3;
-                    break;
-                }
+    free( c->out );
+    free( c->buf );
+    free( c );
+}
 
-                default:
-                    break;
-            }
+/**
+ * @brief Accept every pending client on the listening socket.
+ *
+ * @param w the worker the clients are served by.
+ * @param listenfd the nonblocking listening socket.
+ *
+ * @note The listener is edge-triggered, so keep accepting until EAGAIN.
+ * Every worker shares it, whichever one is woken up takes the clients.
+ */
+static void accept_connections( kl_worker *w, const int listenfd )
+{
+    int connfd; /* the client's fd if one is accepted */
+    struct sockaddr_storage cli_addr; /* either tcp or unix */
+    socklen_t cli_addr_len;
 
-            int len = strlen(memory[loc].dev_name) + strlen(arg) +
-                      MESSAGE_209_LEN;
-            *n = snprintf( buf, len, MESSAGE_209, KL_VERSION,
-                      memory[loc].dev_name, arg );
-        }
-        /* Update dev_state via mqtt */
-        else if ( strncasecmp(req, UPDATE_C, UPDATE_C_LEN) == 0 )
+    for ( ;; )
+    {
+        cli_addr_len = sizeof(cli_addr);
+
+        /* Accept some clients! */
+        if ( (connfd = accept(listenfd, (struct sockaddr*)&cli_addr,
+                              &cli_addr_len)) < 0 )
         {
-            prepare_topic( CMND, memory[loc].mqtt_topic, (char *)STATE );
-            mqtt_publish( cl, topic, "", 0, MQTT_PUBLISH_QOS_0 );
+            /*
+             * Handle potential interrupt beyond our control,
+             * and just start over again.
+             */
+            if ( errno == EINTR || errno == ECONNABORTED )
+            {
+                continue;
+            }
 
-            /* set respective to_change value as needed */
-            switch( to_change[loc] )
+            /*
+             * EAGAIN means the queue is drained, anything else
+             * (like running out of fds) is retried on the next
+             * connection attempt.
+             */
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )
             {
-                case -1:
-                case 0:
-                    to_change[loc] = 0;
-                    break;
+#ifdef DEBUG
+                log_error( "Error Accepting client in server" );
+#endif
+            }
 
-                case 1:
-                {
-                    strncpy( memory[loc].omqtt_topic,
-                             memory[loc].mqtt_topic,
-                             strlen(memory[loc].mqtt_topic) );
+            break;
+        }
 
-                    /* stage to a full update */
-                    to_change[loc] = 3;
-                    break;
-                }
+#ifdef DEBUG
+        if ( cli_addr.ss_family == AF_INET )
+        {
+            struct sockaddr_in *in = (struct sockaddr_in *)&cli_addr;
 
-                case 2:
-                {
-                    strncpy( memory[loc].odev_name,
-                             memory[loc].dev_name,
-                             strlen(memory[loc].dev_name) );
+            log_info( "Accepted new client %s:%d",
+                      inet_ntoa(in->sin_addr), in->sin_port );
+        }
+        else
+        {
+            log_info( "Accepted new local client" );
+        }
+#endif
 
-                    /* stage to a full update */
-                    to_change[loc] = 3;
-                    break;
-                }
+        /*
+         * If there are too many clients, tell the
+         * interested party that there are too many
+         * clients right now.
+         */
+        pthread_mutex_lock( &client_lock );
+        int full = client_count >= conf->max_clients;
+        client_count += !full;
+        pthread_mutex_unlock( &client_lock );
 
-                default:
-                    break;
+        if ( full || open_connection( w, connfd ) == NULL )
+        {
+            if ( !full )
+            {
+                pthread_mutex_lock( &client_lock );
+                client_count--;
+                pthread_mutex_unlock( &client_lock );
             }
 
-            int len = strlen(memory[loc].dev_name) + MESSAGE_210_LEN;
-            *n = snprintf( buf, len, MESSAGE_210, KL_VERSION,
-                      memory[loc].dev_name );
+#ifdef DEBUG
+            log_warn( "Too many clients reached!" );
+#endif
+
+            send( connfd, MESSAGE_505, MESSAGE_505_LEN - 1, MSG_NOSIGNAL );
+            close( connfd );
         }
     }
-
-    pthread_mutex_unlock( lock );
-    sem_post( mutex );
-
-    return rv;
 }
 
 /**
- * @brief Change device's state.
+ * @brief Queue a response for a connection, after any earlier ones.
  *
- * @param dv_name the device name to change.
- * @param cmd the device's command to be sent.
- * @param msg the message to change dev state.
+ * @param c the connection.
+ * @param data the response.
+ * @param len the response length.
  *
- * @note Returns 1 for no such device, Returns 2 for invalid mqtt
- * command, otherwise returns 0.
+ * @note Returns nonzero upon error.
  */
-static int change_dev_state( const char *dv_name, const char *cmd, char *msg )
+static int queue_response( kl_conn *c, const char *data, int len )
 {
-    int rv = 0; /* return value */
-    int loc = -1; /* location of a device match */
-
-    /* Only at this point is memory going to be accessed. */
-    sem_wait( mutex );
-    pthread_mutex_lock( lock );
-
-    /* scan for a dev_name match */
-    for ( int i = 0; i < conf->max_dev_count; i++ )
+    while ( len > 0 )
     {
-        if ( strncasecmp(memory[i].dev_name, dv_name, strlen(dv_name)) == 0 )
+        /* start a new block when the last one is full */
+        if ( c->tail == NULL || c->tail->len == conf->buffer_size )
         {
-            loc = i;
-            break;
-        }
+            kl_out *o = (kl_out *)malloc( sizeof(kl_out) +
+                                          conf->buffer_size );
 
-        /* No matches at all? all done */
-        if ( i == (conf->max_dev_count - 1) )
-        {
-            rv = 1;
-        }
-    }
+            if ( o == NULL )
+            {
+                return 1;
+            }
 
-    /* only continue if a device is found */
-    if ( !rv )
-    {
-        /* verify cmd is acceptable for the device */
-        if ( verify_command( cmd, memory[loc].valid_cmnds ) )
-        {
-            rv = 2;
-        }
+            o->next = NULL;
+            o->len = 0;
+            o->sent = 0;
 
-        /* if the command is valid, ship it! */
-        if ( rv == 0 )
-        {
-            prepare_topic( CMND, memory[loc].mqtt_topic, (char *)cmd );
-            mqtt_publish( cl, topic, msg, strlen(msg),
-                          MQTT_PUBLISH_QOS_0 );
+            if ( c->tail != NULL )
+            {
+                c->tail->next = o;
+            }
+            else
+            {
+                c->head = o;
+            }
+
+            c->tail = o;
         }
-    }
 
-    pthread_mutex_unlock( lock );
-    sem_post( mutex );
+        int room = conf->buffer_size - c->tail->len;
+        int count = len < room ? len : room;
 
-    return rv;
+        memcpy( c->tail->data + c->tail->len, data, count );
+        c->tail->len += count;
+        c->queued += count;
+        data += count;
+        len -= count;
+    }
+
+    return 0;
 }
 
 /**
- * @brief Change device's power state.
+ * @brief Write out as many queued responses as the socket takes.
  *
- * @param dv_name the device name to change.
- * @param cmd the device's command to be sent.
- * @param msg the message to change dev state.
+ * @param c the connection.
  *
- * @note Returns 1 for no such device, otherwise returns 0.
+ * @note Whatever is left gets written once epoll reports the socket as
+ * writable again. Returns nonzero upon error.
  */
-static int toggle_dev_power( const char *dv_name, const char *msg )
+static int flush_responses( kl_conn *c )
 {
-    int rv = 0; /* return value */
-    int loc = -1; /* location of a device match */
-
-    /* Only at this point is memory going to be accessed. */
-    sem_wait( mutex );
-    pthread_mutex_lock( lock );
+    struct iovec iov[OUT_IOV_LEN];
+    struct msghdr msg;
 
-    /* scan for a dev_name match */
-    for ( int i = 0; i < conf->max_dev_count; i++ )
+    while ( c->head != NULL )
     {
-        if ( strncasecmp(memory[i].dev_name, dv_name, strlen(dv_name)) == 0 )
-        {
-            loc = i;
-            break;
-        }
+        int count = 0;
 
-        /* No matches at all? all done */
-        if ( i == (conf->max_dev_count - 1) )
+        for ( kl_out *o = c->head; o != NULL && count < OUT_IOV_LEN;
+              o = o->next )
         {
-            rv = 1;
+            iov[count].iov_base = o->data + o->sent;
+            iov[count].iov_len = o->len - o->sent;
+            count++;
         }
-    }
 
-    /* only continue if a device is found */
-    if ( !rv )
-    {
-        char cmd[DB_CMND_LEN];
-        memset( cmd, 0, DB_CMND_LEN );
+        /* writev() with flags, so a closed client can't raise SIGPIPE */
+        memset( &msg, 0, sizeof(msg) );
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
 
-        /* if a powerstrip set to POWER0 */
-        if ( memory[loc].dev_type == 1 )
+        ssize_t n = sendmsg( c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT );
+
+        if ( n < 0 )
         {
-            snprintf( cmd, DEV_TYPE1B_CMD_LEN, DEV_TYPE1B_CMD, 0 );
-            prepare_topic( CMND, memory[loc].mqtt_topic, cmd );
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+
+            /* socket buffer is full, wait for EPOLLOUT */
+            if ( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                return 0;
+            }
+
+            return 1;
         }
-        else
+
+        c->queued -= n;
+        c->last_active = c->worker->now;
+
+        /* release every block that went out in full */
+        while ( n > 0 )
         {
-            strncpy(cmd, DEV_TYPE0_CMDS, DEV_TYPE0_CMDS_LEN );
-            prepare_topic( CMND, memory[loc].mqtt_topic, cmd );
-        }
+            kl_out *o = c->head;
+            int left = o->len - o->sent;
 
-        mqtt_publish( cl, topic, msg, strlen(msg),
-                      MQTT_PUBLISH_QOS_0 );
-    }
+            if ( n < left )
+            {
+                o->sent += n;
+                break;
+            }
 
-    pthread_mutex_unlock( lock );
-    sem_post( mutex );
+            n -= left;
+            c->head = o->next;
 
-    return rv;
+            if ( c->head == NULL )
+            {
+                c->tail = NULL;
+            }
+
+            free( o );
+        }
+    }
+
+    return 0;
 }
 
 /**
- * @brief Function that prints devices in memory when requested to list
- * devices by client.
+ * @brief Handle every complete request buffered for a connection.
  *
- * @param buf the buffer for the client, to make a tailor made response. In
- * other words, THIS GETS MODIFIED.
- * @param n the buffer length var. this also gets modified when buf gets
- * modifed.
+ * @param c the connection, whatever is left of a partial request is
+ * moved to the start of its buffer.
  *
- * @note This uses semaphores since it access memory to satisfy the request.
+ * @note Requests are terminated by a newline, responses are queued in the
+ * same order. Once OUT_QUEUE_MAX bytes are queued the rest are left until
+ * the client catches up. Returns -1 when the connection should be closed,
+ * 0 otherwise.
  */
-static void dump_devices( char *buf, int *n )
+static int handle_requests( kl_conn *c )
 {
-    /* create new temporary buffers */
-    char tmp[DB_CMND_LEN];
-    char tmp_msg[conf->buffer_size];
-    char *dv_type;
-
-    /* memset buffers to prevent issues down the road */
-    memset( tmp, 0, DB_CMND_LEN );
-    memset( tmp_msg, 0, DB_CMND_LEN );
-
-    /* create first part of message */
-    int len = MESSAGE_204_LEN + get_digit_count( get_current_entry_count() );
-    snprintf( tmp, len, MESSAGE_204, KL_VERSION, get_current_entry_count() );
-    strncat( tmp_msg, tmp, len );
+    int start = 0; /* where the current request starts */
+    int response_len = 0; /* the server's response length to client */
+    int status = 0; /* Status according to what server client wants */
 
-    /* copy the current len */
-    *n = len;
+    for ( int i = 0; i < c->len && c->queued < OUT_QUEUE_MAX; i++ )
+    {
+        if ( c->buf[i] != '\n' )
+        {
+            continue;
+        }
 
-    sem_wait( mutex );
-    pthread_mutex_lock( lock );
+        c->buf[i] = '\0';
 
-    for ( int i = 0; i < conf->max_dev_count; i++ )
-    {
-        /* Empty, move on */
-        if ( memory[i].dev_name[0] == '\0' )
+        /* the tail of an overlong request, already answered */
+        if ( c->discard )
         {
+            c->discard = 0;
+            start = i + 1;
             continue;
         }
 
-        dv_type = device_type_to_str( memory[i].dev_type );
+        /* Parse incoming request */
+        status = parse_server_request( c, c->buf + start, i - start,
+                                       c->out, &response_len );
 
-        len = (DUMP_204_LEN + strlen(memory[i].dev_name) +
-                  strlen(memory[i].mqtt_topic) + strlen(dv_type));
+        start = i + 1;
 
-        snprintf( tmp, len, DUMP_204, memory[i].dev_name,
-                  memory[i].mqtt_topic, dv_type );
+        /* Queue response to client */
+        if ( queue_response( c, c->out, response_len ) || status < 0 )
+        {
+            return -1;
+        }
+    }
 
-        strncat( tmp_msg, tmp, len );
+    /* keep the partial request, or the held back ones, for later */
+    c->len -= start;
 
-        /* increment total len */
-        *n += len;
-        *n -= 1;
+    if ( start > 0 && c->len > 0 )
+    {
+        memmove( c->buf, c->buf + start, c->len );
     }
 
-    /* create a terminating character for this. */
-    strncat( tmp_msg, ".\n", 3 );
+    /* no room left for its newline, so the request is too long */
+    if ( c->len >= conf->buffer_size - 1
+      && memchr( c->buf, '\n', c->len ) == NULL )
+    {
+        if ( !c->discard )
+        {
+            response_len = snprintf( c->out, MESSAGE_400_LEN,
+                                     MESSAGE_400, KL_VERSION );
 
-    /* increment total len */
-    *n += 2;
+            if ( queue_response( c, c->out, response_len ) )
+            {
+                return -1;
+            }
+        }
 
-    /* finally copy over to the buffer */
-    strncpy( buf, tmp_msg, *n );
+        c->len = 0;
+        c->discard = 1;
+    }
 
-    pthread_mutex_unlock( lock );
-    sem_post( mutex );
+    return 0;
 }
 
 /**
- * @brief get current device's state.
+ * @brief the server's connection handler
  *
- * @param dv_name the device name of interest.
- * @param buf the buffer for the client, to make a tailor made response. In
- * other words, THIS GETS MODIFIED.
- * @param n the buffer length var. this also gets modified when buf gets
- * modifed.
+ * @param c the connection that epoll reported as readable or writable.
  *
- * @note Returns 1 for no such device error, returns 0 otherwise.
+ * @note Every pending request is handled, as epoll is edge-triggered,
+ * unless the client is not reading its responses. Returns -1 when the
+ * connection should be closed, 0 otherwise.
  */
-static int get_dev_state( const char *dv_name, char *buf, int *n )
+static int server_connection_handler( kl_conn *c )
 {
-    int rv = 1; /* return value */
-    int loc = -1; /* location of a device match */
+    int n = 0; /* get the length of recv() */
 
-    sem_wait( mutex );
-    pthread_mutex_lock( lock );
-
-    for ( int i = 0; i < conf->max_dev_count; i++ )
+    /* make room first, then catch up on held back requests */
+    if ( flush_responses( c ) || handle_requests( c ) < 0 )
     {
-        if ( strncasecmp(memory[i].dev_name, dv_name, strlen(dv_name)) == 0 )
-        {
-            rv = 0;
-            loc = i;
-            break;
-        }
+        flush_responses( c );
+        return -1;
     }
 
-    if ( !rv )
+    for ( ;; )
     {
-        /* create new temporary buffers */
-        char tmp[DV_STATE_LEN];
-        char tmp_cmnds[DB_CMND_LEN];
-        char elem[JSON_LEN];
+        while ( c->queued < OUT_QUEUE_MAX )
+        {
+            /* Append to any partial request, leaving room for a NUL */
+            n = recv( c->fd, c->buf + c->len,
+                      conf->buffer_size - 1 - c->len, MSG_DONTWAIT );
+
+            if ( n < 0 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+
+                /* nothing more to read for now */
+                if ( errno == EAGAIN || errno == EWOULDBLOCK )
+                {
+                    break;
+                }
 
-        /* memset these buffers to prevent problems */
-        memset( tmp, 0, DV_STATE_LEN );
-        memset( tmp_cmnds, 0, DB_CMND_LEN );
-        memset( elem, 0, JSON_LEN );
+                return -1;
+            }
 
-        /* copy valid commands, ready to go. */
-        strncpy( tmp_cmnds, memory[loc].valid_cmnds,
-                 strlen(memory[loc].valid_cmnds) );
+            /* client must have disconnected, send what's left if possible */
+            if ( n == 0 )
+            {
+                handle_requests( c );
+                flush_responses( c );
+                return -1;
+            }
 
-        char *tok;
-        tok = strtok(tmp_cmnds, ",");
+            c->len += n;
+            c->last_active = c->worker->now;
 
-        /* start with the desired message */
-        strncat( tmp, MESSAGE_206, MESSAGE_206_LEN );
-        strncat( tmp, ":\n", 3 );
+            /* quitting, or out of memory */
+            if ( handle_requests( c ) < 0 )
+            {
+                flush_responses( c );
+                return -1;
+            }
+        }
 
-        while ( tok != 0 )
+        /* everything handled in this pass goes out together */
+        if ( flush_responses( c ) )
         {
-            strncat( tmp, tok, strlen(tok) );
-            strncat( tmp, " : ", 4 );
-            find_jsmn_str( elem, tok, memory[loc].dev_state );
-            strncat( tmp, elem, strlen(elem) );
-            strncat( tmp, "\n", 2 );
-
-            /* next on the list */
-            tok = strtok( 0, "," );
+            return -1;
         }
 
-        /* create a terminating character for this. */
-        strncat( tmp, ".\n", 3 );
+        /*
+         * either the socket is drained, or the client's socket buffer is
+         * full and EPOLLOUT brings us back, otherwise keep reading.
+         */
+        if ( n < 0 || c->queued >= OUT_QUEUE_MAX )
+        {
+            return 0;
+        }
 
-        /* Create response */
-        int len = strlen(memory[loc].dev_name) + strlen(tmp) + 1;
-        *n = snprintf( buf, len, tmp, KL_VERSION, memory[loc].dev_name );
+        /* catch up on requests held back before reading more */
+        if ( handle_requests( c ) < 0 )
+        {
+            flush_responses( c );
+            return -1;
+        }
     }
-
-    pthread_mutex_unlock( lock );
-    sem_post( mutex );
-
-    return rv;
 }
 
 /**
- * @brief Create, Initialize, and return the server's socketfd.
+ * @brief Close every connection that has been idle for idle_timeout
+ * seconds, called once a second by the worker's timerfd.
  *
- * @param port the port the server listens on.
+ * @param w the worker.
  *
- * @note Returns -1 if an error occurs, the actual integer otherwise.
+ * @note Activity only updates a connection's last_active, so a timer
+ * that comes up early is just put back in the wheel. A watcher with
+ * nothing left to read gets WATCH_IDLE_FACTOR times as long, a stalled
+ * one still times out after idle_timeout.
  */
-int create_server_socket( const int port )
+static void expire_idle( kl_worker *w )
 {
-    int fd;
-    struct sockaddr_in serv_addr;
+    uint64_t count;
+    ssize_t n = read( w->timerfd, &count, sizeof(count) );
+    (void)n;
 
-    /* actually create the socket here. */
-    fd = socket( AF_INET, SOCK_STREAM, 0 );
+    w->now = monotonic_seconds();
 
-    if ( fd < 0 )
+    /* every slot passed since the last tick, at most one lap */
+    time_t from = w->now - w->tick > WHEEL_SLOTS ?
+                  w->now - WHEEL_SLOTS : w->tick;
+
+    for ( time_t t = from + 1; t <= w->now; t++ )
     {
-#ifdef DEBUG
-        perror( "error creating socket" );
-        log_error( "error creating socket" );
-#endif
+        int slot = t & (WHEEL_SLOTS - 1);
+        kl_conn *c = w->wheel[slot];
 
-        return -1;
-    }
+        /* taken whole, anything put back lands in the next lap */
+        w->wheel[slot] = NULL;
 
-    /* set serv_addr to 0 initially. */
-    memset( &serv_addr, 0, sizeof(serv_addr) );
+        while ( c != NULL )
+        {
+            kl_conn *next = c->wheel_next;
 
-    serv_addr.sin_family = AF_INET;
+            /* out of the wheel until it's put back */
+            c->wheel_slot = -1;
 
-    /* allow anyone and anything to connect .. for now. */
-    serv_addr.sin_addr.s_addr = htonl( INADDR_ANY );
-    //inet_pton( AF_INET, IP_ADDR, &serv_addr.sin_addr );
+            pthread_mutex_lock( &w->lock );
+            int watching = c->watch_all || c->watched > 0;
+            pthread_mutex_unlock( &w->lock );
+
+            /* a watcher waits on pushes, but not forever */
+            time_t expiry = c->last_active + conf->idle_timeout *
+                            ( watching && c->queued == 0 ?
+                              WATCH_IDLE_FACTOR : 1 );
 
+            if ( expiry > w->now )
+            {
+                wheel_insert( w, c, expiry );
+            }
+            else
+            {
 #ifdef DEBUG
-    log_debug( "using port %u for server", (port & 0xffff) );
+                log_info( "Closing idle client" );
 #endif
 
-    serv_addr.sin_port = htons( port & 0xffff );
+                /* a stalled client has responses queued ahead of this */
+                if ( c->queued == 0 )
+                {
+                    char msg[MESSAGE_410_LEN];
+                    int len = snprintf( msg, MESSAGE_410_LEN, MESSAGE_410,
+                                        KL_VERSION );
+                    send( c->fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT );
+                }
 
-    /* Bind the fd */
-    if ( bind( fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr) ) < 0 )
-    {
-#ifdef DEBUG
-        perror( "Error binding" );
-        log_error( "Error binding server socket" );
-#endif
+                close_connection( c );
+            }
 
-        fd = -1;
+            c = next;
+        }
     }
 
-    /* Return the completed process. */
-    return fd;
+    w->tick = w->now;
 }
 
 /**
- * @brief the server's connection handler
+ * @brief A worker's network loop, until it's exit time.
  *
- * @param connfds the pollfd array of clients.
- * @param num the count of clients in the pollfd array.
+ * @param w the worker, its listener already registered.
  *
+ * @note Returns 1 for any errors that
+ * may arise, returns 0 otherwise.
  */
-static void server_connection_handler( struct pollfd *connfds, const int num )
+static int run_worker( kl_worker *w )
 {
-    int count; /* To handle connections */
-    int n = 0; /* get the length of read() and write() functions */
-    int response_len = 0; /* the server's response length to client */
-    int status = 0; /* Status according to what server client wants */
+    int rv = 0; /* return value, assume all is well */
+    int nready;
+    struct epoll_event events[EPOLL_EVENTS];
 
-    for ( count = 1; count <= num; count++ )
+    /* run until it's exit time */
+    while ( closeSocket == 0 )
     {
-        /* No connection, move on */
-        if ( connfds[count].fd < 0 )
+        nready = epoll_wait( w->epfd, events, EPOLL_EVENTS, -1 );
+
+        if ( nready < 0 )
         {
-            continue;
+            /* likely SIGINT, closeSocket gets checked above */
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+
+#ifdef DEBUG
+            log_error( "Error polling in server" );
+#endif
+
+            rv = 1;
+            break;
         }
 
-        if ( connfds[count].revents & POLLIN )
+        /*
+         * both may close any connection, so they wait until every event
+         * of this round is handled, none is left pointing at a freed one.
+         */
+        int expire = 0;
+        int push = 0;
+
+        for ( int i = 0; i < nready; i++ )
         {
-            /* Retreive request from client */
-            n = read( connfds[count].fd, server_buffer[count - 1],
-                      conf->buffer_size );
+            kl_conn *c = (kl_conn *)events[i].data.ptr;
 
-            /* client must have disconnected, move on */
-            /* set equal to 0 if bugs come up! */
-            if ( n <= 0 )
+            if ( c == &w->listen_conn || c == &w->unix_conn )
             {
-                close( connfds[count].fd );
-                connfds[count].fd = -1;
-                continue;
+                accept_connections( w, c->fd );
+            }
+            else if ( c == &w->timer_conn )
+            {
+                expire = 1;
             }
+            else if ( c == &w->wake_conn )
+            {
+                /* exit is handled by the loop condition, else push states */
+                uint64_t count;
+                ssize_t n = read( w->wakefd, &count, sizeof(count) );
+                (void)n;
+
+                push = 1;
+            }
+            /* handle the connection */
+            else if ( server_connection_handler( c ) < 0 )
+            {
+                close_connection( c );
+            }
+        }
+
+        if ( push )
+        {
+            push_notifications( w );
+        }
 
-            /* Parse incoming request */
-            status = parse_server_request( server_buffer[count - 1],
-                                           &response_len );
+        if ( expire )
+        {
+            expire_idle( w );
+        }
+    }
 
-            /* Write response to client */
-            n = write( connfds[count].fd, server_buffer[count - 1],
-                       response_len );
+    /* exit cleanly */
+    while ( w->connections != NULL )
+    {
+        close_connection( w->connections );
+    }
 
-            /* Reset respective buffer */
-            memset( server_buffer[count - 1], 0, conf->buffer_size );
+    return rv;
+}
 
-            /* Handle exit if client wants to exit */
-            if ( status < 0 )
-            {
-                close( connfds[count].fd );
-                connfds[count].fd = -1;
-            }
-        }
+/**
+ * @brief Thread function for every worker but the first.
+ *
+ * @param arg the worker.
+ */
+static void *worker_thread( void *arg )
+{
+    /* one worker failing takes the rest down with it */
+    if ( run_worker( (kl_worker *)arg ) )
+    {
+        close_socket();
     }
+
+    return NULL;
 }
 
 /**
- * @brief the server's network loop
+ * @brief the server's network loop, run by every worker. The calling
+ * thread serves as the first worker, and the rest get their own threads.
  *
  * @param listenfd the socket created using
  * the function create_server_socket(port)
+ * @param unixfd the socket created using the function
+ * create_unix_socket(path), or -1 for none.
  *
  * @note Returns 1 for any errors that
  * may arise, returns 0 otherwise.
  */
-int server_loop( const int listenfd )
+int server_loop( const int listenfd, const int unixfd )
 {
     int rv = 0; /* return value, assume all is well */
-    int connfd; /* the client's fd if one is accepted */
-    int maxi = 0;
-    int nready;
-    int count;
-    struct sockaddr_in cli_addr;
-    socklen_t cli_addr_len = sizeof(cli_addr);
+    int started = 1; /* workers running, the first being this thread */
+    struct epoll_event ev;
 
-    /* first client is the server itself. */
-    clientfds[0].fd = listenfd;
-    clientfds[0].events = POLLIN;
+    /* listeners are drained on every wakeup, so make them nonblocking */
+    fcntl( listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK );
 
-    /* Initialize all other clients. */
-    for ( int i = 1; i < POLL_SIZE; i++ )
+    if ( unixfd >= 0 )
     {
-        clientfds[i].fd = -1;
+        fcntl( unixfd, F_SETFL, fcntl(unixfd, F_GETFL) | O_NONBLOCK );
     }
 
-    /* run forever! */
-    for ( ;; )
+    for ( ; started < worker_count; started++ )
     {
-        /* Wait for file descriptor to be ready in 50ms */
-        nready = poll( clientfds, maxi+1, 50 );
+        kl_worker *w = &workers[started];
 
-        if ( nready < 0 )
+        if ( pthread_create( &w->thread, NULL, worker_thread, w ) )
         {
 #ifdef DEBUG
-            log_error( "Error polling in server" );
+            log_warn( "Unable to start server worker %d", started );
 #endif
 
-            rv = 1;
             break;
         }
+    }
 
-        if ( clientfds[0].revents & POLLIN )
-        {
-            /* Accept some clients! */
-            if ( (connfd = accept(listenfd, (struct sockaddr*)&cli_addr,
-                                  &cli_addr_len)) < 0 )
-            {
-                /*
-                 * Handle potential interrupt beyond our control,
-                 * and just start over again.
-                 */
-                if ( errno == EINTR )
-                {
-#ifdef DEBUG
-                    log_info( "Got interrupted with EINTR, continuing." );
-#endif
-
-                    continue;
-                }
-                else
-                {
-#ifdef DEBUG
-                    log_error( "Error Accepting client in server" );
-#endif
-                    rv = 1;
-                    break;
-                }
-            }
-
-#ifdef DEBUG
-            log_info( "Accepted new client %s:%d",
-                      inet_ntoa(cli_addr.sin_addr),
-                      cli_addr.sin_port );
-#endif
-
-            /* Add the client to next available clientfds slot. */
-            for ( count = 1; count < POLL_SIZE; count++ )
-            {
-                if ( clientfds[count].fd < 0 )
-                {
-                    clientfds[count].fd = connfd;
-                    break;
-                }
-
-                /*
-                 * Made it this far into the loop,
-                 * increment count, there are too many clients.
-                 * Handle accordingly.
-                 */
-                if ( count == (POLL_SIZE - 1) )
-                {
-                    count++;
-                }
-            }
-
-            /*
-             * If there are too many clients, tell the
-             * interested party that there are too many
-             * clients right now.
-             */
-            if ( count >= POLL_SIZE )
-            {
-#ifdef DEBUG
-                log_warn( "Too many clients reached!" );
-#endif
-
-                write( connfd, MESSAGE_505, MESSAGE_505_LEN );
-                close( connfd );
-            }
-
-            /* Set the clientfds as poll input. */
-            clientfds[count].events = POLLIN;
+    /*
+     * every running worker waits on the listeners, EPOLLEXCLUSIVE wakes
+     * just one of them for each new client rather than all of them.
+     */
+    for ( int i = 0; i < started; i++ )
+    {
+        kl_worker *w = &workers[i];
 
-            /* set or reset maxi if count is greater than it. */
-            maxi = ( count > maxi ? count : maxi );
+        w->listen_conn.fd = listenfd;
+        ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+        ev.data.ptr = &w->listen_conn;
+        epoll_ctl( w->epfd, EPOLL_CTL_ADD, listenfd, &ev );
 
-            if ( --nready <= 0 )
-            {
-                continue;
-            }
+        if ( unixfd >= 0 )
+        {
+            w->unix_conn.fd = unixfd;
+            ev.data.ptr = &w->unix_conn;
+            epoll_ctl( w->epfd, EPOLL_CTL_ADD, unixfd, &ev );
         }
+    }
 
-        /* handle the connection */
-        server_connection_handler( clientfds, maxi );
+    rv = run_worker( &workers[0] );
 
-        /* If it's exit time, exit cleanly */
-        if ( closeSocket > 0 )
-        {
-            rv = 0;
-            close( clientfds[0].fd );
-            clientfds[0].fd = -1;
-            break;
-        }
+    /* in case this worker stopped on an error */
+    close_socket();
+
+    for ( int i = 1; i < started; i++ )
+    {
+        pthread_join( workers[i].thread, NULL );
     }
 
     return rv;
@@ -1695,7 +3652,19 @@ int server_loop( const int listenfd )
 /* ability to close the socket */
 void close_socket()
 {
+    int saved_errno = errno; /* this may be called from a signal handler */
+
     closeSocket = 1;
+
+    /* wake every worker, write() is safe within a signal handler */
+    for ( int i = 0; i < worker_count; i++ )
+    {
+        uint64_t one = 1;
+        ssize_t n = write( workers[i].wakefd, &one, sizeof(one) );
+        (void)n;
+    }
+
+    errno = saved_errno;
 }
 
 /*******************************************************************************
@@ -1808,108 +3777,227 @@ int initialize_mqtt( struct mqtt_client *client, int *sockfd,
         return 1;
     }
 
+    mqtt_wakefd = eventfd( 0, EFD_NONBLOCK );
+
+    if ( mqtt_wakefd < 0 )
+    {
+#ifdef DEBUG
+        log_error( "Unable to create mqtt eventfd" );
+#endif
+
+        return 1;
+    }
+
+    /* state_applier() blocks reading this until states are pushed */
+    applier_wakefd = eventfd( 0, 0 );
+
+    if ( applier_wakefd < 0 || state_ring_init( &states, conf->state_buff ) )
+    {
+#ifdef DEBUG
+        log_error( "Unable to set up the state applier" );
+#endif
+
+        return 1;
+    }
+
     cl = client;
 
     return 0;
 }
 
+/**
+ * @brief Close the eventfds used to wake the mqtt refresher and the
+ * state applier, and free the states not yet applied.
+ *
+ * @note Only call once both threads have been joined.
+ */
+void close_mqtt()
+{
+    if ( mqtt_wakefd >= 0 )
+    {
+        close( mqtt_wakefd );
+        mqtt_wakefd = -1;
+    }
+
+    if ( applier_wakefd >= 0 )
+    {
+        close( applier_wakefd );
+        applier_wakefd = -1;
+    }
+
+    state_ring_free( &states );
+    states_pushed = 0;
+}
+
+/**
+ * @brief Subscribe to the stat topics of every device in memory.
+ *
+ * @note With wildcard_subscribe set, one stat/+/RESULT subscription
+ * (and stat/+/STATE if wildcard_state is set) covers every device,
+ * present and future. Call after initialize_mqtt().
+ */
+void subscribe_devices()
+{
+    if ( conf->wildcard_subscribe )
+    {
+        mqtt_subscribe( cl, STAT_RESULT_ALL, 0 );
+
+#ifdef DEBUG
+        log_info( "subscribed to %s", STAT_RESULT_ALL );
+#endif
+
+        if ( conf->wildcard_state )
+        {
+            mqtt_subscribe( cl, STAT_STATE_ALL, 0 );
+
+#ifdef DEBUG
+            log_info( "subscribed to %s", STAT_STATE_ALL );
+#endif
+        }
+
+        return;
+    }
+
+    /* A loop to subscribe all the stat topics */
+    for ( int i = 0; i < memory->capacity; i++ )
+    {
+        const db_data *dev = DB_DEVICE(memory, i);
+
+        /* Empty, move on */
+        if ( dev->dev_name[0] == '\0' )
+        {
+            continue;
+        }
+
+        prepare_topic( topic, STAT, dev->mqtt_topic, (char *)RESULT );
+        mqtt_subscribe( cl, topic, 0 );
+
+#ifdef DEBUG
+        log_info( "subscribed to %s", topic );
+#endif
+    }
+}
+
 /**
  * @brief The mqtt publish (when subscribed) callback function.
  *
  * @param client not used
  * @param published contains topic_name and application_message
  *
+ * @note The message is only pushed onto the state ring here,
+ * state_applier() applies it.
  */
 void publish_kl_callback( void** client,
                          struct mqtt_response_publish *published )
 {
-    /*
-     * If a device state changes, update it accordingly
-     */
-    sem_wait( mutex );
-    pthread_mutex_lock( lock );
-
-    int topic_found = -1;
-    int loc = -1;
-
-    strncpy( app_msg, published->application_message,
-             published->application_message_size );
-
     // for debugging purposes
 #ifdef DEBUG
-    printf( "%s\n", published->topic_name );
-    printf( "app_msg: %s\n", app_msg );
+    printf( "%.*s\n", (int)published->topic_name_size,
+            (const char *)published->topic_name );
+    printf( "app_msg: %.*s\n", (int)published->application_message_size,
+            (const char *)published->application_message );
 #endif
 
-    /* Find a match! */
-    for ( int i = 0; i < conf->max_dev_count; i++ )
+    /* a full ring means the applier is behind, so drop it */
+    if ( state_ring_push( &states, (const char *)published->topic_name,
+                          published->topic_name_size,
+                          (const char *)published->application_message,
+                          published->application_message_size ) )
     {
-        prepare_topic( STAT, memory[i].mqtt_topic, (char *)RESULT );
-        if ( strncasecmp(topic, published->topic_name,
-                         strlen(topic)) == 0 )
-        {
 #ifdef DEBUG
-            printf( "found match\n" );
+        log_warn( "State ring full, dropped a device state" );
 #endif
-            topic_found = 1;
-            loc = i;
-            break;
-        }
 
-        /* no matching topics? for now just quietly ignore. */
-        if ( i == (conf->max_dev_count - 1) )
-        {
-            topic_found = 0;
-        }
+        return;
+    }
+
+    states_pushed = 1;
+}
+
+/**
+ * @brief Apply up to STATE_BATCH_LEN states from the state ring.
+ *
+ * @note Only called by state_applier(). Returns nonzero if the ring
+ * still holds states afterwards.
+ */
+static int apply_device_states()
+{
+    const char *tpc;
+    const char *msg;
+    int tpc_len;
+    int msg_len;
+    int applied = 0;
+
+    if ( state_ring_peek( &states, &tpc, &tpc_len, &msg, &msg_len ) )
+    {
+        return 0;
     }
 
-    /* match found, update the dev_state */
-    if ( topic_found )
+    /*
+     * If a device state changes, update it accordingly
+     */
+    pthread_rwlock_wrlock( lock );
+
+    do
     {
-        /* Check if app message is the full state */
-        if ( published->application_message_size < DV_STATE_TMPL_LEN )
+        /* Find a match! no matching topics? for now just quietly ignore. */
+        int loc = find_topic_route( tpc, tpc_len );
+
+        if ( loc < 0 )
         {
-            /* change only the locations of interest */
-            replace_jsmn_property( memory[loc].dev_state, app_msg );
+            state_ring_pop( &states );
+            continue;
         }
-        else
-        {
-            /* memset the dev_state */
-            memset( memory[loc].dev_state, 0, DV_STATE_LEN );
 
-            /* copy app_msg as state */
-            strncpy( memory[loc].dev_state, app_msg,
-                     published->application_message_size );
+#ifdef DEBUG
+        printf( "found match\n" );
+#endif
+
+        db_data *dev = DB_DEVICE(memory, loc);
+        db_detail *dd = dev->detail;
+        int changed = 0;
+
+        /* change only the properties present, full states included */
+        merge_dev_state( &dd->dev_state, msg, msg_len, &changed );
+        state_ring_pop( &states );
+
+        /* the same values again, nothing to push or persist */
+        if ( !changed )
+        {
+            continue;
         }
 
+        touch_device( loc, 0 );
+        notify_watchers( loc );
+
         /* make sure a change is not already staged */
-        switch( to_change[loc] )
+        switch( dev->to_change )
         {
             // Only state needs to be updated, continue
             case -1:
             case 0:
-                to_change[loc] = 0;
+                dev->to_change = 0;
                 break;
 
             // dev_name is to be updated, stage as a full update
             case 1:
             {
-                strncpy( memory[loc].omqtt_topic,
-                         memory[loc].mqtt_topic,
-                         strlen(memory[loc].mqtt_topic) );
+                strncpy( dd->omqtt_topic,
+                         dev->mqtt_topic,
+                         strlen(dev->mqtt_topic) );
 
-                to_change[loc] = 3;
+                dev->to_change = 3;
                 break;
             }
 
             // mqtt_topic is to be updated, stage a full update
             case 2:
             {
-                strncpy( memory[loc].odev_name,
-                         memory[loc].dev_name,
-                         strlen(memory[loc].dev_name) );
+                strncpy( dd->odev_name,
+                         dev->dev_name,
+                         strlen(dev->dev_name) );
 
-                to_change[loc] = 3;
+                dev->to_change = 3;
                 break;
             }
 
@@ -1917,35 +4005,212 @@ void publish_kl_callback( void** client,
             {
                 /* ignore, leave value alone */
 #ifdef DEBUG
-                log_warn( "Found case %d", to_change[loc] );
+                log_warn( "Found case %d", dev->to_change );
 #endif
                 break;
             }
         }
-    }
 
-    /* memset topic and app message buffers for later use */
-    memset( topic, 0, conf->topic_buff );
-    memset( app_msg, 0, conf->app_msg_buff );
+        queue_db_change( loc );
+    }
+    while ( ++applied < STATE_BATCH_LEN &&
+            !state_ring_peek( &states, &tpc, &tpc_len, &msg, &msg_len ) );
 
     /* All done! (for now) */
-    pthread_mutex_unlock( lock );
-    sem_post( mutex );
+    pthread_rwlock_unlock( lock );
+
+    /* let the workers push the changes out */
+    wake_workers();
+
+    return applied == STATE_BATCH_LEN;
+}
+
+/**
+ * @brief Wake the state applier, as states were just pushed.
+ */
+static void wake_applier()
+{
+    uint64_t one = 1;
+    ssize_t n = write( applier_wakefd, &one, sizeof(one) );
+    (void)n;
+}
+
+/**
+ * @brief Wait up to coalesce_delay milliseconds for more states, or until
+ * the state ring is half full, whichever comes first.
+ *
+ * @note Only called by state_applier(), once woken up with more than
+ * one state on the ring.
+ */
+static void coalesce_states()
+{
+    struct timespec now;
+    struct timespec end;
+    uint64_t count;
+
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    end.tv_sec += conf->coalesce_delay / 1000;
+    end.tv_nsec += ( conf->coalesce_delay % 1000 ) * 1000000L;
+
+    if ( end.tv_nsec >= 1000000000L )
+    {
+        end.tv_sec++;
+        end.tv_nsec -= 1000000000L;
+    }
+
+    /* the mqtt thread wakes the applier as it pushes, so check again */
+    while ( state_ring_used( &states ) < states.size / 2 )
+    {
+        clock_gettime( CLOCK_MONOTONIC, &now );
+
+        long ms = ( end.tv_sec - now.tv_sec ) * 1000L +
+                  ( end.tv_nsec - now.tv_nsec + 999999L ) / 1000000L;
+
+        if ( ms <= 0 )
+        {
+            break;
+        }
+
+        struct pollfd pfd = { .fd = applier_wakefd, .events = POLLIN };
+
+        if ( poll( &pfd, 1, (int)ms ) > 0 )
+        {
+            ssize_t n = read( applier_wakefd, &count, sizeof(count) );
+            (void)n;
+        }
+    }
+}
+
+/**
+ * @brief the state applier, which applies the states the mqtt thread
+ * received, so the mqtt thread never waits on the device table lock.
+ *
+ * @param args is not used.
+ *
+ * @note Blocks reading its eventfd until states are pushed. A lone state
+ * is applied at once, otherwise it waits up to coalesce_delay milliseconds
+ * so that states close together are applied in one batch, letting
+ * requests in between batches.
+ */
+void *state_applier( void *args )
+{
+    uint64_t count;
+    int cancel_state;
+    int more = 0;
+
+    while ( 1 )
+    {
+        /* a batch left states behind, so there's no need to wait */
+        if ( !more )
+        {
+            ssize_t n = read( applier_wakefd, &count, sizeof(count) );
+            (void)n;
+
+            /*
+             * a lone state is applied at once, but if others already
+             * follow it a burst is arriving, so let the rest of it in,
+             * each property then ends up with its latest value under
+             * one hold of the lock
+             */
+            if ( conf->coalesce_delay > 0 && state_ring_backlog( &states ) )
+            {
+                coalesce_states();
+            }
+        }
+
+        /* the lock is held throughout, so hold off on being cancelled */
+        pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, &cancel_state );
+        more = apply_device_states();
+        pthread_setcancelstate( cancel_state, NULL );
+
+        /* still a point to be cancelled at, if it never waits */
+        pthread_testcancel();
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Wake the mqtt refresher, as a message was just queued.
+ */
+static void wake_mqtt()
+{
+    uint64_t one = 1;
+    __atomic_store_n( &mqtt_queued, 1, __ATOMIC_RELEASE );
+    ssize_t n = write( mqtt_wakefd, &one, sizeof(one) );
+    (void)n;
 }
 
 /**
  * @brief the refresher which sends/receives mqtt responses
- * at every roughly 100ms
+ * as soon as the broker socket is ready, or a message is queued.
  *
  * @param client is the struct mqtt_client to pass in.
+ *
+ * @note Blocks in poll() on the broker socket and the wake eventfd,
+ * for at most MQTT_SYNC_TIMEOUT so keep-alives and ack timeouts
+ * are still handled when idle.
  */
 void *client_refresher(void* client)
 {
+    struct mqtt_client *c = (struct mqtt_client*) client;
+    struct pollfd fds[2];
+    uint64_t count;
+
     while(1)
     {
-        mqtt_sync( (struct mqtt_client*) client );
+        /* taken before syncing, so anything queued later wakes it again */
+        int queued = __atomic_exchange_n( &mqtt_queued, 0, __ATOMIC_ACQ_REL );
+        enum MQTTErrors err = mqtt_sync( c );
+
+        /* once per sync, however many states it received */
+        if ( states_pushed )
+        {
+            states_pushed = 0;
+            wake_applier();
+        }
+
+        /*
+         * a burst of requests can fill the send buffer, which mqtt-c
+         * treats as sticky, failing everything after it. The requests
+         * that did not fit were answered with a 500, and the buffer drains
+         * as it's sent, so log it and allow queueing again.
+         */
+        MQTT_PAL_MUTEX_LOCK( &c->mutex );
+        if ( c->error == MQTT_ERROR_SEND_BUFFER_IS_FULL )
+        {
+#ifdef DEBUG
+            log_error( "mqtt error: %s, raise snd_buff",
+                       mqtt_error_str(c->error) );
+#endif
+
+            c->error = MQTT_OK;
+        }
+        MQTT_PAL_MUTEX_UNLOCK( &c->mutex );
+
+        /* a broken connection would poll readable forever, so skip it */
+        fds[0].fd = ( err == MQTT_OK ) ? c->socketfd : -1;
+        fds[0].events = POLLIN;
 
-        usleep( 100000U );
+        /*
+         * a full socket leaves what was queued partly unsent, sync once
+         * more as soon as it takes more, rather than on the next wakeup
+         */
+        if ( fds[0].fd >= 0 && queued )
+        {
+            fds[0].events |= POLLOUT;
+        }
+
+        fds[1].fd = mqtt_wakefd;
+        fds[1].events = POLLIN;
+
+        if ( poll( fds, 2, MQTT_SYNC_TIMEOUT ) > 0
+          && ( fds[1].revents & POLLIN ) )
+        {
+            /* reset the eventfd, whatever was queued gets synced */
+            ssize_t n = read( mqtt_wakefd, &count, sizeof(count) );
+            (void)n;
+        }
     }
     return NULL;
 }
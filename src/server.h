@@ -10,7 +10,7 @@
 
 /*
  * This header is mostly used to define a default port,
- * maximum number of connections (POLL_SIZE)
+ * epoll batch size (EPOLL_EVENTS),
  * listenq (LISTEN_QUEUE) size, and buffer size.
  *
  * This is also likely not the correct way to do this sort of thing,
@@ -21,8 +21,7 @@
 
 /* Includes in case the compiler complains */
 #include <pthread.h>
-#include <semaphore.h>
-#include <poll.h>
+#include <time.h>
 
 /* To make sure config data type is known about. */
 #include "config.h"
@@ -40,6 +39,7 @@
 #define MESSAGE_203 ((const char *)"KL/%.1f 203 device %s deleted\n")
 #define MESSAGE_204 ((const char *)"KL/%.1f 204 number of devices: %d\n")
 #define DUMP_204    ((const char *)"%s -- %s -- %s\n")
+#define STATE_206   ((const char *)"%s : %s\n")
 #define MESSAGE_205 ((const char *)"KL/%.1f 205 custom command %s %s sent\n")
 #define MESSAGE_206 ((const char *)"KL/%.1f 206 device %s state:\n")
 #define MESSAGE_207 ((const char *)"KL/%.1f 207 goodbye\n")
@@ -48,6 +48,9 @@
 "updated to %s\n")
 #define MESSAGE_210 ((const char *)"KL/%.1f 210 dev_name %s dev_state " \
 "updated\n")
+#define MESSAGE_211 ((const char *)"KL/%.1f 211 device %s state changed:\n")
+#define MESSAGE_212 ((const char *)"KL/%.1f 212 watching %s\n")
+#define MESSAGE_213 ((const char *)"KL/%.1f 213 stopped watching %s\n")
 
 #define MESSAGE_400 ((const char *)"KL/%.1f 400 bad request\n")
 //#define MESSAGE_401 ((const char *)"KL/%.1f 401 device %s state unknown\n")
@@ -59,6 +62,7 @@
 #define MESSAGE_407 ((const char *)"KL/%.1f 407 not yet implemented\n")
 #define MESSAGE_408 ((const char *)"KL/%.1f 408 device %s already exists\n")
 #define MESSAGE_409 ((const char *)"KL/%.1f 409 not enough args passed in\n")
+#define MESSAGE_410 ((const char *)"KL/%.1f 410 idle timeout\n")
 
 #define MESSAGE_500 ((const char *)"KL/%.1f 500 internal error: %s\n")
 #define MESSAGE_505 ((const char *)"KL/0.3 505 client capacity full, " \
@@ -79,6 +83,9 @@
 #define STATUS      ((const char *)"STATUS")
 #define QA          ((const char *)"Q")
 #define QB          ((const char *)"QUIT")
+#define WATCH       ((const char *)"WATCH")
+#define UNWATCH     ((const char *)"UNWATCH")
+#define WATCH_ALL   ((const char *)"*")
 
 /* Constants for MQTT */
 // mqtt topic prefix
@@ -91,16 +98,37 @@
 #define MQTT_UPDATE ((const char *)"/TOPIC")
 #define POWER       ((const char *)"/POWER")
 
+// wildcard topics, for every device at once
+#define STAT_RESULT_ALL ((const char *)"stat/+/RESULT")
+#define STAT_STATE_ALL  ((const char *)"stat/+/STATE")
+
 enum {
-    // should be at least 2
-    POLL_SIZE = 11,
-    LISTEN_QUEUE = 10,
-    ARG_BUF_LEN = 256,
+    // events handled per epoll_wait() call, not a client limit
+    EPOLL_EVENTS = 64,
+    LISTEN_QUEUE = 128,
     ARG_LEN = 6,
 
+    // blocks handed to a single writev() when flushing responses
+    OUT_IOV_LEN = 16,
+
+    // in bytes, queued responses before a client's requests are held back
+    OUT_QUEUE_MAX = 65536,
+
+    // idle timer wheel, one slot per second, must be a power of 2
+    WHEEL_SLOTS = 64,
+
+    // idle_timeouts a watcher with nothing left to read may go quiet for
+    WATCH_IDLE_FACTOR = 4,
+
     // in seconds
     KEEP_ALIVE = 400,
 
+    // in milliseconds, longest the mqtt refresher blocks when idle
+    MQTT_SYNC_TIMEOUT = 1000,
+
+    // received states applied per hold of the device table lock
+    STATE_BATCH_LEN = 256,
+
     /*
      * Response messages
      */
@@ -110,12 +138,16 @@ enum {
     MESSAGE_203_LEN = 28,
     MESSAGE_204_LEN = 32,
     DUMP_204_LEN = 10,
+    STATE_206_LEN = 5,
     MESSAGE_205_LEN = 34,
     MESSAGE_206_LEN = 27,
     MESSAGE_207_LEN = 20,
     MESSAGE_208_LEN = 34,
     MESSAGE_209_LEN = 45,
     MESSAGE_210_LEN = 40,
+    MESSAGE_211_LEN = 35,
+    MESSAGE_212_LEN = 22,
+    MESSAGE_213_LEN = 30,
     MESSAGE_400_LEN = 24,
     //MESSAGE_401_LEN = 34,
     MESSAGE_402_LEN = 30,
@@ -126,6 +158,7 @@ enum {
     MESSAGE_407_LEN = 32,
     MESSAGE_408_LEN = 35,
     MESSAGE_409_LEN = 38,
+    MESSAGE_410_LEN = 25,
     MESSAGE_500_LEN = 29,
     MESSAGE_505_LEN = 50,
 
@@ -136,13 +169,25 @@ enum {
     ADD_REQ_LEN = 3,
     DEL_REQ_LEN = 6,
     UPDATE_REQ_LEN = 6,
-    UPDATE_A_LEN = 5,
-    UPDATE_B_LEN = 6,
-    UPDATE_C_LEN = 6,
+    UPDATE_A_LEN = 4,
+    UPDATE_B_LEN = 5,
+    UPDATE_C_LEN = 5,
     LIST_LEN = 4,
     STATUS_LEN = 6,
     QA_LEN = 1,
     QB_LEN = 4,
+    WATCH_LEN = 5,
+    UNWATCH_LEN = 7,
+    WATCH_ALL_LEN = 1,
+
+    // verb lookup tables, sized for verb_hash() to never collide
+    VERB_TABLE_LEN = 32,
+    UPDATE_TABLE_LEN = 4,
+
+    // UPDATE sub-verbs
+    UPDATE_NAME = 0,
+    UPDATE_TOPIC = 1,
+    UPDATE_STATE = 2,
 
     // expected arg counts for each request type
     TRANSMIT_ARG = 4,
@@ -154,6 +199,7 @@ enum {
     UPDATE_ARG = 4,
     LIST_ARG = 2,
     STATUS_ARG = 3,
+    WATCH_ARG = 3,
 
     // prefix (for topics)
     STAT_LEN = 6,
@@ -163,10 +209,163 @@ enum {
     RESULT_LEN = 8,
     STATE_LEN = 7,
     MQTT_UPDATE_LEN = 7,
-    POWER_LEN = 7
+    POWER_LEN = 7,
+
+    // wildcard topics
+    STAT_RESULT_ALL_LEN = 14,
+    STAT_STATE_ALL_LEN = 13
 
 };
 
+/**
+ * @typedef kl_cache
+ * @brief a response rendered once, and served until its version changes.
+ */
+typedef struct kl_cache
+{
+    unsigned int version;
+    int len;
+    int size;
+    char *data;
+} kl_cache;
+
+/**
+ * @typedef kl_arg
+ * @brief a single request argument, as a slice of the read buffer.
+ */
+typedef struct kl_arg
+{
+    int off;
+    int len;
+} kl_arg;
+
+/**
+ * @typedef kl_out
+ * @brief a block of responses queued for a client, buffer_size bytes long.
+ */
+typedef struct kl_out
+{
+    struct kl_out *next;
+
+    /* bytes filled, and bytes of those already written */
+    int len;
+    int sent;
+    char data[];
+} kl_out;
+
+/**
+ * @typedef kl_conn
+ * @brief per-connection state, allocated when a client connects
+ * and free'd when it disconnects.
+ */
+typedef struct kl_conn
+{
+    int fd;
+    char *buf;
+    char *out;
+
+    /* bytes of buf holding a partial request, awaiting its newline */
+    int len;
+
+    /* set while the rest of an overlong request is thrown away */
+    int discard;
+
+    /* responses waiting for the socket to be writable, oldest first */
+    kl_out *head;
+    kl_out *tail;
+    int queued;
+
+    /*
+     * watched device slots as a bitmap of watch_size bytes, allocated on
+     * the first WATCH and grown when a later slot is watched.
+     */
+    unsigned char *watch;
+    int watch_size;
+    int watched;
+    int watch_all;
+
+    /* last time anything was read or written, and its idle timer */
+    time_t last_active;
+    int wheel_slot;
+    struct kl_conn *wheel_prev;
+    struct kl_conn *wheel_next;
+
+    /* the worker serving it, and its other connections */
+    struct kl_worker *worker;
+    struct kl_conn *prev;
+    struct kl_conn *next;
+} kl_conn;
+
+/**
+ * @typedef kl_worker
+ * @brief a server thread, with its own epoll instance and connections.
+ */
+typedef struct kl_worker
+{
+    pthread_t thread;
+    int epfd;
+
+    /* written to upon exit, or when a watched device's state changes */
+    int wakefd;
+
+    /* told apart from client connections by their address */
+    kl_conn listen_conn;
+    kl_conn unix_conn;
+    kl_conn wake_conn;
+    kl_conn timer_conn;
+    kl_conn *connections;
+
+    /*
+     * idle timers, a connection sits in the slot of the second it would
+     * time out, and is checked again or closed once that slot comes up.
+     * timerfd ticks every second while idle_timeout is set.
+     */
+    int timerfd;
+    time_t now;
+    time_t tick;
+    kl_conn *wheel[WHEEL_SLOTS];
+
+    /*
+     * slots whose state changed while one of its connections was watching,
+     * each queued once. Any thread may queue, or delete a watched device,
+     * so this guards the queue and the connections' watch sets.
+     */
+    pthread_mutex_t lock;
+    int *notify_slots;
+    int *notify_work;
+    unsigned char *notify_queued;
+    int notify_count;
+
+    /* slots notify_work has room for, only touched by this worker */
+    int work_size;
+    int watch_count;
+    char *push_buf;
+
+    /* only used by the state applier, set when this worker needs waking */
+    int notified;
+} kl_worker;
+
+/**
+ * @typedef kl_handler
+ * @brief handles a single request verb, writing the response to buf.
+ */
+typedef int (*kl_handler)( kl_conn *c, char **req_args, const kl_arg *args,
+                           const int arg_count, char *buf, int *n );
+
+/**
+ * @typedef kl_verb
+ * @brief a request verb, or an UPDATE sub-verb, in a lookup table.
+ */
+typedef struct kl_verb
+{
+    const char *name;
+    int len;
+
+    /* minimum arg count for verbs, the sub-verb itself otherwise */
+    int arg;
+    kl_handler handler;
+} kl_verb;
+
 /*******************************************************************************
  * Non-specific server-related initializations will reside here.
  * such as: sharing pointers to some buffers
@@ -174,22 +373,32 @@ enum {
  * Also where misc functions will reside as well.
  ******************************************************************************/
 
-void assign_buffers( char **srvr_buf, char *tpc, char *application_msg,
-                     db_data *data, config *cfg, int *to_chng,
-                     pthread_mutex_t *lck, sem_t *mtx,
-                     struct pollfd *czfds );
+void assign_buffers( char *tpc, char *application_msg,
+                     db_table *data, config *cfg, pthread_rwlock_t *lck );
 
-void prepare_topic( const char *prefix, const char *tpc,
+void prepare_topic( char *dst, const char *prefix, const char *tpc,
                     char *suffix );
 
+int initialize_topic_routes();
+void free_topic_routes();
+
+int initialize_response_cache();
+void free_response_cache();
+
+int initialize_workers();
+void free_workers();
+
 /*******************************************************************************
  * Server function declarations will reside here.
  ******************************************************************************/
 /* A way to create a socket for the kisslight server. */
 int create_server_socket( const int port );
 
+/* A way to create a socket for local clients. */
+int create_unix_socket( const char *path );
+
 /* server's loop */
-int server_loop( int listenfd );
+int server_loop( int listenfd, int unixfd );
 
 /* a way to cleanly exit */
 void close_socket();
@@ -204,9 +413,15 @@ int initialize_mqtt( struct mqtt_client *client, int *sockfd,
                                uint8_t *snd_buf, uint8_t *recv_buf,
                                config *conf );
 
+void close_mqtt();
+
+void subscribe_devices();
+
 void publish_kl_callback(void** client,
                          struct mqtt_response_publish *published);
 
 void* client_refresher(void* client);
 
+void *state_applier( void *args );
+
 #endif
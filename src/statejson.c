@@ -1,5 +1,5 @@
 /*
- * Change dev_states of devices given the input.
+ * Keep dev_states of devices as property tables, given json input.
  *
  * SPDX-License-Identifier: BSD-3-Clause
  * Copyright (C) 2019-2021, Christian Kissinger
@@ -13,170 +13,288 @@
 // system-related includes
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 // local includes
 #include "statejson.h"
 #include "jsmn/jsmn.h"
 
 /**
- * @brief Simple function to do the strncmp work for the programmer.
+ * @brief Find a property in a state table.
  *
- * @param json the full json string of interest
- * @param tok the jsmn token to be passed in.
- * @param s the target property to compare against.
+ * @param st the state table.
+ * @param key the property name, need not be terminated.
+ * @param len the length of key.
  *
- * @note Returns nonzero upon error.
+ * @note Property names match case-insensitively.
+ * Returns the field's index, or -1 if there is no such property.
  */
-static int jsoneq(const char *json, jsmntok_t *tok, const char *s)
+static int find_field( const state_table *st, const char *key, const int len )
 {
-    int rv = -1;
-
-    /*
-     * If it MUST be a string, just include the following:
-     *  tok->type == JSMN_STRING &&
-     */
-    if ( (int)strlen(s) == tok->end - tok->start &&
-         strncasecmp(json + tok->start, s, tok->end - tok->start) == 0)
+    for ( int i = 0; i < st->count; i++ )
     {
-        rv = 0;
+        if ( st->fields[i].key_len == len &&
+             strncasecmp(st->data + st->fields[i].key, key, len) == 0 )
+        {
+            return i;
+        }
     }
 
-  return rv;
+    return -1;
 }
 
 /**
- * @brief find the matching element, given given a device ID, property.
+ * @brief Pack the data of a state table, dropping replaced values.
  *
- * @param dst Where the result gets stored, THIS GETS MODIFIED HERE!
- * @param property The desired member of a given state json string.
- * @param state the state json string.
+ * @param st the state table, THIS GETS MODIFIED HERE!
+ */
+static void compact_dev_state( state_table *st )
+{
+    char tmp[STATE_DATA_LEN];
+    int used = 0;
+
+    for ( int i = 0; i < st->count; i++ )
+    {
+        state_field *f = &st->fields[i];
+
+        memcpy( tmp + used, st->data + f->key, f->key_len );
+        f->key = used;
+        used += f->key_len;
+
+        memcpy( tmp + used, st->data + f->val, f->val_len );
+        f->val = used;
+        used += f->val_len;
+    }
+
+    memcpy( st->data, tmp, used );
+    st->used = used;
+}
+
+/**
+ * @brief Set one property of a state table.
  *
- * @note This may not be the most efficient means of retreiving
- * the desired element, but it will work as intended.
- * Return 0 upon success, nonzero for any error that occurs.
+ * @param st the state table, THIS GETS MODIFIED HERE!
+ * @param key the property name, need not be terminated.
+ * @param key_len the length of key.
+ * @param val the value, need not be terminated.
+ * @param val_len the length of val.
+ * @param is_str nonzero if val is a json string (without its quotes).
+ * @param changed set nonzero if the value changed, THIS GETS MODIFIED.
+ *
+ * @note Returns nonzero if the table has no room left for it, the table
+ * and changed are then left as they were.
  */
-int find_jsmn_str( char *dst, const char *property, const char *state )
+static int set_field( state_table *st, const char *key, const int key_len,
+                      const char *val, const int val_len, const int is_str,
+                      int *changed )
 {
-    int rv = 0;
-    jsmn_parser p;
-    jsmntok_t t[TOK_LEN];
+    int i = find_field( st, key, key_len );
 
-    jsmn_init( &p );
-    int r = jsmn_parse(&p, state, strlen(state), t, TOK_LEN );
+    /* the same value again, nothing to do */
+    if ( i >= 0 && val_len == st->fields[i].val_len &&
+         is_str == st->fields[i].is_str &&
+         memcmp(st->data + st->fields[i].val, val, val_len) == 0 )
+    {
+        return 0;
+    }
 
-    for ( int i = 0; i < r; i++ )
+    /* same size or smaller values simply overwrite the old one */
+    if ( i >= 0 && val_len <= st->fields[i].val_len )
     {
-        if ( jsoneq(state, &t[i], property) == 0 )
+        memcpy( st->data + st->fields[i].val, val, val_len );
+        st->fields[i].val_len = val_len;
+        st->fields[i].is_str = is_str;
+        *changed = 1;
+
+        return 0;
+    }
+
+    if ( i < 0 && st->count == STATE_FIELDS )
+    {
+        return 1;
+    }
+
+    int need = val_len + ( (i < 0) ? key_len : 0 );
+
+    if ( st->used + need > STATE_DATA_LEN )
+    {
+        /*
+         * count what compacting would leave, the old value is going away,
+         * so the table is only touched once the new one is sure to fit
+         */
+        int live = 0;
+
+        for ( int j = 0; j < st->count; j++ )
         {
-            snprintf(dst, t[i + 1].end - t[i + 1].start + 1, "%.*s",
-                    t[i + 1].end - t[i + 1].start,
-                    state + t[i + 1].start );
+            live += st->fields[j].key_len;
+            live += ( j != i ) ? st->fields[j].val_len : 0;
+        }
 
-            break;
+        if ( live + need > STATE_DATA_LEN )
+        {
+            return 1;
         }
 
-        /* if nothing is found, set the return value to nonzero */
-        if ( i == (r - 1) )
+        if ( i >= 0 )
         {
-            rv = 1;
+            st->fields[i].val_len = 0;
         }
+
+        compact_dev_state( st );
     }
 
-    return rv;
+    /* a new property, its name goes first */
+    if ( i < 0 )
+    {
+        i = st->count++;
+        st->fields[i].key = st->used;
+        st->fields[i].key_len = key_len;
+        memcpy( st->data + st->used, key, key_len );
+        st->used += key_len;
+    }
+
+    st->fields[i].val = st->used;
+    st->fields[i].val_len = val_len;
+    st->fields[i].is_str = is_str;
+    memcpy( st->data + st->used, val, val_len );
+    st->used += val_len;
+    *changed = 1;
+
+    return 0;
 }
 
 /**
- * @brief Update parts of a state string given new state values
+ * @brief Empty a state table.
  *
- * @param state the state, THIS GETS MODIFIED HERE!
- * @param nstate the new state values.
+ * @param st the state table, THIS GETS MODIFIED HERE!
+ */
+void init_dev_state( state_table *st )
+{
+    memset( st, 0, sizeof(state_table) );
+}
+
+/**
+ * @brief Update a state table given new state values.
+ *
+ * @param st the state table, THIS GETS MODIFIED HERE!
+ * @param json a json object of new state values, need not be terminated.
+ * @param len the length of json.
+ * @param changed set nonzero if any property's value changed, left alone
+ * otherwise, may be NULL. THIS GETS MODIFIED.
  *
- * @note It is assumed that everything in the json is in order
- * with the state string, it may not work if everything is jumbled.
- * Returns 0 upon success, nonzero for any error that occurs.
+ * @note Properties may come in any order, only the ones present change.
+ * Nested objects are replaced whole. Returns 0 upon success, nonzero if
+ * json is not an object or some property did not fit.
  */
-int replace_jsmn_property( char *state, const char *nstate )
+int merge_dev_state( state_table *st, const char *json, const int len,
+                     int *changed )
 {
     int rv = 0;
+    int dummy = 0;
     jsmn_parser p;
-    jsmn_parser pn;
     jsmntok_t t[TOK_LEN];
-    jsmntok_t tn[TOK_LEN];
-    char prop[JSON_LEN];
-    char elem[JSON_LEN];
-    char end[JSON_LEN];
-
-    memset( prop, 0, JSON_LEN );
-    memset( elem, 0, JSON_LEN );
-    memset( end, 0, JSON_LEN );
 
     jsmn_init( &p );
-    jsmn_init( &pn );
+    int r = jsmn_parse( &p, json, len, t, TOK_LEN );
 
-    int r = jsmn_parse( &p, state, strlen(state), t, TOK_LEN );
-    int rn = jsmn_parse( &pn, nstate, strlen(nstate), tn, TOK_LEN );
+    if ( r < 1 || t[0].type != JSMN_OBJECT )
+    {
+        return 1;
+    }
 
     int i = 1;
-    int j = 1;
+    while ( i + 1 < r )
+    {
+        jsmntok_t *key = &t[i];
+        jsmntok_t *val = &t[i + 1];
+
+        if ( set_field(st, json + key->start, key->end - key->start,
+                       json + val->start, val->end - val->start,
+                       val->type == JSMN_STRING,
+                       changed != NULL ? changed : &dummy) )
+        {
+            rv = 1;
+        }
+
+        /* move on to the next property, past anything nested */
+        for ( i += 2; i < r && t[i].start < val->end; i++ );
+    }
+
+    return rv;
+}
+
+/**
+ * @brief find the value of a property in a state table.
+ *
+ * @param dst Where the result gets stored, THIS GETS MODIFIED HERE!
+ * @param len the size of dst.
+ * @param property The desired property, matched case-insensitively.
+ * @param st the state table.
+ *
+ * @note dst is left empty if there is no such property.
+ * Return 0 upon success, nonzero for any error that occurs.
+ */
+int find_dev_state( char *dst, const int len, const char *property,
+                    const state_table *st )
+{
+    int i = find_field( st, property, strlen(property) );
+
+    if ( i < 0 )
+    {
+        dst[0] = '\0';
+        return 1;
+    }
+
+    snprintf( dst, len, "%.*s", st->fields[i].val_len,
+              st->data + st->fields[i].val );
+
+    return 0;
+}
+
+/**
+ * @brief Serialize a state table back to a json object.
+ *
+ * @param dst Where the json gets stored, THIS GETS MODIFIED HERE!
+ * @param len the size of dst.
+ * @param st the state table.
+ *
+ * @note Properties that do not fit in dst are left out.
+ * Returns the length of the json.
+ */
+int dev_state_to_json( char *dst, const int len, const state_table *st )
+{
+    int n = 0;
+
+    /* room for the braces and the terminator */
+    if ( len < 3 )
+    {
+        dst[0] = '\0';
+        return 0;
+    }
 
-    /* Copy first property and item to scan for */
-    snprintf( prop, tn[j].end - tn[j].start + 1, "%.*s",
-              tn[j].end - tn[j].start, nstate + tn[j].start );
-    snprintf( elem, tn[j + 1].end - tn[j + 1].start + 1, "%.*s",
-              tn[j + 1].end - tn[j + 1].start, nstate + tn[j + 1].start );
+    dst[n++] = '{';
 
-    for ( i = 1; i < r; i += 2 )
+    for ( int i = 0; i < st->count; i++ )
     {
-        if ( jsoneq(state, &t[i], prop) == 0 )
+        const state_field *f = &st->fields[i];
+
+        /* quotes, colon, comma, closing brace and terminator */
+        int need = f->key_len + f->val_len + ( f->is_str ? 2 : 0 ) + 6;
+
+        if ( n + need > len )
         {
-            /* if elements match, don't bother and move on */
-            if ( jsoneq(state, &t[i + 1], elem) == 0 )
-            {
-                j += 2;
-
-                if ( j >= rn )
-                {
-                    break;
-                }
-
-                snprintf( prop, tn[j].end - tn[j].start + 1, "%.*s",
-                tn[j].end - tn[j].start, nstate + tn[j].start );
-                snprintf( elem, tn[j + 1].end - tn[j + 1].start + 1, "%.*s",
-                tn[j + 1].end - tn[j + 1].start, nstate + tn[j + 1].start );
-
-                continue;
-            }
-
-            /* Update String here */
-            int str_diff = strlen(elem) - (t[i + 1].end - t[i + 1].start);
-
-            memcpy( end, state + t[i + 1].end, strlen(state) - t[i + 1].end );
-            memset( state + t[i + 1].end, 0, strlen(state) - t[i + 1].end );
-            memcpy( state + t[i + 1].start, elem, strlen(elem) );
-            memcpy( state + t[i + 1].start + strlen(elem), end, strlen(end) );
-            memset( end, 0, JSON_LEN );
-
-            t[i + 1].end += str_diff;
-            for ( int m = (i + 2); m < r; m++ )
-            {
-                t[m].start += str_diff;
-                t[m].end += str_diff;
-            }
-
-            /* increment j and either finish or continue */
-            j += 2;
-
-            if ( j >= rn )
-            {
-                break;
-            }
-
-            snprintf( prop, tn[j].end - tn[j].start + 1, "%.*s",
-            tn[j].end - tn[j].start, nstate + tn[j].start );
-            snprintf( elem, tn[j + 1].end - tn[j + 1].start + 1, "%.*s",
-            tn[j + 1].end - tn[j + 1].start, nstate + tn[j + 1].start );
+            break;
         }
+
+        n += sprintf( dst + n, "%s\"%.*s\":%s%.*s%s", (n > 1) ? "," : "",
+                      f->key_len, st->data + f->key,
+                      f->is_str ? "\"" : "",
+                      f->val_len, st->data + f->val,
+                      f->is_str ? "\"" : "" );
     }
 
-    return rv;
+    dst[n++] = '}';
+    dst[n] = '\0';
+
+    return n;
 }
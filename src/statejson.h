@@ -14,12 +14,50 @@
 /* Constants */
 
 enum {
-    TOK_LEN = 64,
-    JSON_LEN = 512
+    TOK_LEN = 128,
+    JSON_LEN = 512,
+
+    // top level properties kept per device
+    STATE_FIELDS = 32,
+
+    // room for every property name and value, same as the json state
+    STATE_DATA_LEN = 1024
 };
 
+/**
+ * @typedef state_field
+ * @brief where a property's name and value sit in a state_table's data.
+ *
+ * @note string values are kept without their quotes, anything else
+ * (numbers, nested objects, ...) is kept as its raw json text.
+ */
+typedef struct
+{
+    unsigned short key;
+    unsigned short key_len;
+    unsigned short val;
+    unsigned short val_len;
+    unsigned char is_str;
+} state_field;
+
+/**
+ * @typedef state_table
+ * @brief a device state, as its top level json properties.
+ */
+typedef struct
+{
+    state_field fields[STATE_FIELDS];
+    int count;
+    int used;
+    char data[STATE_DATA_LEN];
+} state_table;
+
 /* prototypes */
-int find_jsmn_str( char *dst, const char *property, const char *state );
-int replace_jsmn_property( char *state, const char *nstate );
+void init_dev_state( state_table *st );
+int merge_dev_state( state_table *st, const char *json, const int len,
+                     int *changed );
+int find_dev_state( char *dst, const int len, const char *property,
+                    const state_table *st );
+int dev_state_to_json( char *dst, const int len, const state_table *st );
 
-#endif
\ No newline at end of file
+#endif
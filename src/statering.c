@@ -0,0 +1,233 @@
+/*
+ * A bounded ring of received device states, handed from the mqtt thread
+ * to the state applier without either of them taking a lock. It is only
+ * safe with exactly one thread pushing and one thread peeking and popping.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (C) 2019-2021, Christian Kissinger
+ * kiss-light Hub is released under the New BSD license (see LICENSE).
+ * Go to the project repo here:
+ * https://gitlab.com/kiss-light-project/Kiss-Light_Hub
+ *
+ * Written by: Christian Kissinger
+ */
+
+// system-related includes
+#include <stdlib.h>
+#include <string.h>
+
+// local includes
+#include "statering.h"
+
+/**
+ * @typedef ring_record
+ * @brief header of a state in the ring, followed by topic_len bytes of
+ * topic and msg_len bytes of message. A topic_len of -1 marks the rest of
+ * the ring as unused, the next record starts back at the beginning.
+ */
+typedef struct
+{
+    int topic_len;
+    int msg_len;
+} ring_record;
+
+/* records start aligned to their header */
+#define RECORD_ALIGN(len) \
+    (((len) + sizeof(ring_record) - 1) & ~(sizeof(ring_record) - 1))
+
+/*
+ * The other thread's counter is loaded with acquire, and our own stored
+ * with release, so a record's bytes are seen before the counter moving
+ * past it is.
+ */
+#define LOAD_ACQUIRE(p) __atomic_load_n( (p), __ATOMIC_ACQUIRE )
+#define STORE_RELEASE(p, v) __atomic_store_n( (p), (v), __ATOMIC_RELEASE )
+
+/**
+ * @brief Allocate a ring of at least size bytes.
+ *
+ * @param r the ring, THIS GETS MODIFIED.
+ * @param size the bytes wanted, rounded up to a power of 2.
+ *
+ * @note Returns nonzero upon error.
+ */
+int state_ring_init( state_ring *r, const int size )
+{
+    unsigned int cap = STATE_RING_MIN;
+
+    while ( cap < (unsigned int)size && cap < (1U << 30) )
+    {
+        cap <<= 1;
+    }
+
+    r->buf = (char *)malloc( cap );
+    r->size = r->buf != NULL ? cap : 0;
+    r->head = 0;
+    r->tail = 0;
+
+    return r->buf == NULL;
+}
+
+/**
+ * @brief Free a ring.
+ *
+ * @param r the ring.
+ *
+ * @note Safe to call even if state_ring_init() was not, or failed.
+ */
+void state_ring_free( state_ring *r )
+{
+    free( r->buf );
+    r->buf = NULL;
+    r->size = 0;
+    r->head = 0;
+    r->tail = 0;
+}
+
+/**
+ * @brief Push a state onto the ring, from the pushing thread only.
+ *
+ * @param r the ring.
+ * @param tpc the topic it arrived on, need not be terminated.
+ * @param tpc_len the length of tpc.
+ * @param msg the message, need not be terminated.
+ * @param msg_len the length of msg.
+ *
+ * @note Returns nonzero if the ring has no room for it.
+ */
+int state_ring_push( state_ring *r, const char *tpc, const int tpc_len,
+                     const char *msg, const int msg_len )
+{
+    unsigned int len = RECORD_ALIGN( sizeof(ring_record) + tpc_len + msg_len );
+    unsigned int head = r->head;
+    unsigned int room = r->size - (head - LOAD_ACQUIRE( &r->tail ));
+    unsigned int pos = head & (r->size - 1);
+    unsigned int skip = 0;
+
+    /* records never wrap, so one too long for the end starts over */
+    if ( len > r->size - pos )
+    {
+        skip = r->size - pos;
+    }
+
+    if ( skip + len > room )
+    {
+        return 1;
+    }
+
+    if ( skip > 0 )
+    {
+        ring_record mark = { -1, 0 };
+
+        memcpy( r->buf + pos, &mark, sizeof(mark) );
+        pos = 0;
+    }
+
+    ring_record rec = { tpc_len, msg_len };
+
+    memcpy( r->buf + pos, &rec, sizeof(rec) );
+    memcpy( r->buf + pos + sizeof(rec), tpc, tpc_len );
+    memcpy( r->buf + pos + sizeof(rec) + tpc_len, msg, msg_len );
+
+    STORE_RELEASE( &r->head, head + skip + len );
+
+    return 0;
+}
+
+/**
+ * @brief Look at the oldest state on the ring, from the applying thread
+ * only. It stays on the ring, and its bytes valid, until state_ring_pop().
+ *
+ * @param r the ring.
+ * @param tpc set to the state's topic, THIS GETS MODIFIED.
+ * @param tpc_len set to the length of tpc, THIS GETS MODIFIED.
+ * @param msg set to the state's message, THIS GETS MODIFIED.
+ * @param msg_len set to the length of msg, THIS GETS MODIFIED.
+ *
+ * @note Returns nonzero if the ring is empty.
+ */
+int state_ring_peek( state_ring *r, const char **tpc, int *tpc_len,
+                     const char **msg, int *msg_len )
+{
+    unsigned int head = LOAD_ACQUIRE( &r->head );
+    ring_record rec;
+
+    while ( r->tail != head )
+    {
+        unsigned int pos = r->tail & (r->size - 1);
+
+        memcpy( &rec, r->buf + pos, sizeof(rec) );
+
+        /* the rest of the ring went unused, the record is at the start */
+        if ( rec.topic_len < 0 )
+        {
+            STORE_RELEASE( &r->tail, r->tail + (r->size - pos) );
+            continue;
+        }
+
+        *tpc = r->buf + pos + sizeof(rec);
+        *tpc_len = rec.topic_len;
+        *msg = *tpc + rec.topic_len;
+        *msg_len = rec.msg_len;
+
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Drop the state state_ring_peek() last returned, handing its
+ * room back to the pushing thread.
+ *
+ * @param r the ring, not empty.
+ */
+void state_ring_pop( state_ring *r )
+{
+    ring_record rec;
+
+    memcpy( &rec, r->buf + (r->tail & (r->size - 1)), sizeof(rec) );
+
+    unsigned int len = RECORD_ALIGN( sizeof(ring_record) + rec.topic_len +
+                                     rec.msg_len );
+
+    STORE_RELEASE( &r->tail, r->tail + len );
+}
+
+/**
+ * @brief How much of the ring is taken, from the applying thread only.
+ *
+ * @param r the ring.
+ *
+ * @note Returns the bytes taken, out of r->size.
+ */
+unsigned int state_ring_used( state_ring *r )
+{
+    return LOAD_ACQUIRE( &r->head ) - r->tail;
+}
+
+/**
+ * @brief Check if more states wait behind the oldest one, from the
+ * applying thread only.
+ *
+ * @param r the ring.
+ *
+ * @note Returns nonzero if the ring holds more than one state.
+ */
+int state_ring_backlog( state_ring *r )
+{
+    const char *tpc;
+    const char *msg;
+    int tpc_len;
+    int msg_len;
+
+    /* also steps over an unused end, so tail is at the oldest record */
+    if ( state_ring_peek( r, &tpc, &tpc_len, &msg, &msg_len ) )
+    {
+        return 0;
+    }
+
+    unsigned int len = RECORD_ALIGN( sizeof(ring_record) + tpc_len + msg_len );
+
+    return LOAD_ACQUIRE( &r->head ) - r->tail > len;
+}
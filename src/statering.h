@@ -0,0 +1,49 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright (C) 2019-2021, Christian Kissinger
+ * kiss-light Hub is released under the New BSD license (see LICENSE).
+ * Go to the project repo here:
+ * https://gitlab.com/kiss-light-project/Kiss-Light_Hub
+ *
+ * Written by: Christian Kissinger
+ */
+
+#ifndef STATERING_H_
+#define STATERING_H_
+
+/* Constants */
+enum {
+    /* smallest ring, must be a power of 2 */
+    STATE_RING_MIN = 256
+};
+
+/**
+ * @typedef state_ring
+ * @brief received device states, from the one thread pushing them to
+ * the one thread applying them, without a lock. head and tail only ever
+ * count up, they are masked by size to find where they point.
+ */
+typedef struct
+{
+    char *buf;
+    unsigned int size;
+
+    /* only written by the pushing thread */
+    unsigned int head;
+
+    /* only written by the applying thread */
+    unsigned int tail;
+} state_ring;
+
+/* prototypes */
+int state_ring_init( state_ring *r, const int size );
+void state_ring_free( state_ring *r );
+int state_ring_push( state_ring *r, const char *tpc, const int tpc_len,
+                     const char *msg, const int msg_len );
+int state_ring_peek( state_ring *r, const char **tpc, int *tpc_len,
+                     const char **msg, int *msg_len );
+void state_ring_pop( state_ring *r );
+unsigned int state_ring_used( state_ring *r );
+int state_ring_backlog( state_ring *r );
+
+#endif